@@ -0,0 +1,21 @@
+/*------------------------------------------------------
+
+	EEPROM for the native build of sdisk2.c
+
+------------------------------------------------------*/
+
+// EEMEM variables are plain variables, they keep their contents
+// between init() calls as the EEPROM does between card inserts
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <string.h>
+
+#define EEMEM
+
+#define eeprom_read_byte(adr) (*(const unsigned char *)(adr))
+#define eeprom_update_byte(adr, v) (*(unsigned char *)(adr) = (v))
+#define eeprom_read_block(dst, src, n) memcpy((dst), (src), (n))
+#define eeprom_update_block(src, dst, n) memcpy((dst), (src), (n))
+
+#endif
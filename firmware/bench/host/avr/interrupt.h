@@ -0,0 +1,17 @@
+/*------------------------------------------------------
+
+	interrupts for the native build of sdisk2.c
+
+------------------------------------------------------*/
+
+// the interrupt handlers in sub.S are not built for the host,
+// the ones in sdisk2.c are plain functions
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define cli()
+#define sei()
+#define ISR_NOBLOCK
+#define ISR(vector, ...) void vector(void)
+
+#endif
@@ -0,0 +1,62 @@
+/*------------------------------------------------------
+
+	AVR registers for the native build of sdisk2.c
+
+------------------------------------------------------*/
+
+/*
+PORTD and PIND are function calls so that the SD card model sees every
+write, see hostbench.c. a PORTD write is passed on when the next write
+or read of port D comes, which keeps the order of the edges.
+the other registers are plain variables, ICR1 and TCNT1 as the bench sets
+them.
+*/
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+extern volatile unsigned char PORTB, PORTC, DDRB, DDRC, DDRD, PINB, PINC;
+extern volatile unsigned char TIMSK0, EIMSK, OCR0A, TCCR0A, TCCR0B, MCUCR, EICRA;
+extern volatile unsigned char PCMSK0, PCICR;
+extern volatile unsigned char TCCR1A, TCCR1B, TIMSK1, TIFR1, ACSR, ADCSRB, ADMUX;
+extern volatile unsigned char TCCR2A, TCCR2B, TIFR2;
+extern volatile unsigned short ICR1, TCNT1;
+
+volatile unsigned char *hostPortd(void);
+unsigned char hostPind(void);
+
+#define PORTD (*hostPortd())
+#define PIND (hostPind())
+
+#define TOIE0 0
+#define INT0 0
+#define PCIE0 0
+#define CS10 0
+#define ICES1 6
+#define ICNC1 7
+#define ICIE1 5
+#define ICF1 5
+#define ACIC 2
+#define ACO 5
+#define ACBG 6
+#define ACME 6
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define TOV2 0
+
+// the crystal of the Makefile
+#ifndef F_CPU
+#define F_CPU 27000000UL
+#endif
+
+// the handler is a plain function the bench calls
+#define PCINT0_vect __vector_3
+#define INT0_vect __vector_1
+#define TIMER1_CAPT_vect __vector_10
+
+#define _BV(bit) (1<<(bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+#endif
@@ -0,0 +1,16 @@
+/*------------------------------------------------------
+
+	program memory for the native build of sdisk2.c
+
+------------------------------------------------------*/
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#define PROGMEM
+typedef unsigned char prog_uchar;
+
+#define pgm_read_byte_near(adr) (*(const unsigned char *)(adr))
+#define pgm_read_byte(adr) (*(const unsigned char *)(adr))
+
+#endif
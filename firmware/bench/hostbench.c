@@ -0,0 +1,780 @@
+/*------------------------------------------------------
+
+	native SDISK II bench on a disk image
+
+------------------------------------------------------*/
+
+/*
+builds sdisk2.c for the host with the headers in host/avr in place of the AVR
+headers. port D goes to the SD card model (sdcard.c), so the FAT, image
+mapping, DSK encoding and write-back code runs on a raw FAT16 image
+without an AVR. the interrupt handlers in sub.S are not built, the bench
+does their part: it reads the sectors the way __vector_16 does and fills
+the write buffers the way __vector_1 does.
+
+each high level operation is run in turn and the SD card traffic it
+causes is reported:
+
+	mount		init(), BPB, root directory and the image extent map, with
+				the EEPROM erased as on a new unit: a catalog card mounts
+				its first record
+	remount		init() again, the card matches the mount kept in the EEPROM,
+				the root directory is read as far as it is in use
+	rewrite		init() with another first cluster in the image's directory
+				entry, same name and time stamp, the EEPROM entry is not taken
+	restore		the cluster put back and the EEPROM entry dropped, the image
+				another one was mounted in place of is mapped again
+	newer		init() with a copy of the image's entry, one day newer, in the
+				first root entry never used: it is mounted unless a catalog
+				picks the image; then the copy is dropped again and the card
+				mounted cold
+	findExt		a root directory scan for the image
+	track		the 16 sectors of track 0 as they pass under the head, all
+				16 address fields must be seen
+	seek		the head stepped phase by phase to the target track, no main()
+				in between, and the first sector there; past a full extent
+				map each FAT sector is read once
+	flush		writeBack() of captured sectors on the target track until full,
+				the other sectors of the track are read first
+	verify		the written sectors read back and compared, the other ones
+				must be unchanged
+	reread		one more sector captured and read back at once, it is sent
+				from the write buffer and stays there, only the sectors
+				after it are read
+	switch		a switch command to the next image
+				of the catalog sent through the phases and switchImage(),
+				the catalog is not looked up again
+	back		the command to the previous image, the sector read back; on
+				a card without a catalog init() mounts the image again, on
+				one with a catalog the previous of the first record is the
+				last one
+	idle		a sector captured and left for FLUSH_IDLE in Timer2
+				overflows, another one and the drive turned off; each is
+				written back by idleFlush() then, and both are read back
+
+a WOZ image is write protected, flush and verify are skipped.
+
+built with -DWRITE_ICP, the flush sends each data field as flux
+transitions to the input capture handlers instead, with the host's clock
+off by up to 2%, and main()'s part is icpTake(). another data field is
+written while a DSK block goes back with its other half in readData, as
+the hardware would take it: only if INT0 is not masked.
+
+built with -DSTATS, the counters of sdisk2.c are written to the STA file
+on the image after the mount and printed at the end.
+
+a PO, HDV or 2MG image is served on the SmartPort bus, the bench sends the
+command and data packets as the host does, captured in writeData as
+__vector_1 leaves them, and checks the responses spExec() builds:
+
+	init		INIT of unit 1
+	status		the device status and the DIB
+	read		a block and the two around it, past a full extent map each
+				FAT sector is read once
+	write		WRITEBLOCK of the block
+	verify		the three blocks read back, only the one written changed
+	errors		a block past the end, a packet to another unit and one
+				with a broken checksum
+
+usage: hostbench [-c] [-n nac] [-b busy] [-t track] disk.img
+	-c			SDHC card (block addressing)
+	-n nac		0xff bytes before each data token (default 1)
+	-b busy		busy bytes after each written block (default 4)
+	-t track	target track of the seek and the flush (default 17)
+
+the image is written to, run it on a copy.
+PINC is 0, the drive is enabled.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sdcard.h"
+
+#define main sdisk2Main
+#include "../sdisk2.c"
+#undef main
+
+volatile unsigned char PORTB, PORTC, DDRB, DDRC, DDRD, PINB, PINC;
+volatile unsigned char TIMSK0, EIMSK, OCR0A, TCCR0A, TCCR0B, MCUCR, EICRA;
+volatile unsigned char PCMSK0, PCICR;
+volatile unsigned char TCCR1A, TCCR1B, TIMSK1, TIFR1, ACSR, ADCSRB, ADMUX;
+volatile unsigned char TCCR2A, TCCR2B, TIFR2;
+volatile unsigned short ICR1, TCNT1;
+
+static volatile unsigned char portd;
+static int pending;
+static unsigned char wreq = 0x04;
+#ifdef WRITE_ICP
+static void flushWrite(void);
+#endif
+
+// a PORTD write, the previous one goes to the card now
+volatile unsigned char *hostPortd(void)
+{
+	if (pending) sdPortd(portd);
+	pending = 1;
+	return &portd;
+}
+
+// D0: DO, D2: no write request, D3: card inserted
+unsigned char hostPind(void)
+{
+	if (pending) sdPortd(portd);
+	pending = 0;
+#ifdef WRITE_ICP
+	flushWrite();
+#endif
+	return (unsigned char)(wreq|(sdDo()?0x01:0x00));
+}
+
+void wait5(unsigned short time)
+{
+	(void)time;
+}
+
+static struct sdStats last;
+
+static void report(const char *name)
+{
+	unsigned long total = 0, i;
+
+	if (pending) sdPortd(portd);
+	pending = 0;
+	for (i=0; i<64; i++) total += sdStats.cmds[i]-last.cmds[i];
+	printf("%-10s %5lu %5lu %5lu %5lu %5lu %5lu %8lu %6lu %6lu %5lu %5lu\n", name,
+		sdStats.cmds[17]-last.cmds[17], sdStats.cmds[18]-last.cmds[18],
+		sdStats.cmds[12]-last.cmds[12], sdStats.cmds[24]-last.cmds[24],
+		sdStats.cmds[25]-last.cmds[25],
+		total-(sdStats.cmds[17]-last.cmds[17])-(sdStats.cmds[18]-last.cmds[18])-
+		(sdStats.cmds[12]-last.cmds[12])-(sdStats.cmds[24]-last.cmds[24])-
+		(sdStats.cmds[25]-last.cmds[25]),
+		sdStats.bytes-last.bytes, sdStats.busy-last.busy, sdStats.wait-last.wait,
+		sdStats.blocksRead-last.blocksRead, sdStats.blocksWritten-last.blocksWritten);
+	last = sdStats;
+}
+
+// the most CMD17 a walk of the FAT past a full extent map may take: each
+// FAT sector from the last cluster mapped to where the walk stopped once,
+// and one more for each of n lookups going on from there
+static unsigned long walkReads(unsigned char n)
+{
+	unsigned char e = (unsigned char)(imgExtNum-1);
+	unsigned short ft = (unsigned short)(imgExtFt[e]+(imgExtLc[imgExtNum]-1-imgExtLc[e]));
+
+	if (imgExtLc[EXT_NUM+1]==0xffff) return 0;
+	return (unsigned long)((imgExtFt[EXT_NUM]>>8)-(ft>>8)+1+n);
+}
+
+// the most CMD17 building the extent map takes, the FAT sectors of each extent
+static unsigned long mapReads(void)
+{
+	unsigned long n = 0;
+	unsigned char e;
+
+	for (e=0; e<imgExtNum; e++)
+		n += (unsigned long)(((imgExtFt[e]+(imgExtLc[e+1]-imgExtLc[e])-1)>>8)-(imgExtFt[e]>>8)+1);
+	return n;
+}
+
+#ifdef STATS
+// the counters kept by sdisk2.c so far
+static void printStats(void)
+{
+	unsigned char i;
+
+	printf("stats      misses %lu, token waits", (unsigned long)stats.misses);
+	for (i=0; i<8; i++) printf(" %u", stats.tokenWait[i]);
+	printf(", retries %u, busy %lu, FAT walks %u, cancels %u, flushes %u, saves %u\n",
+		stats.retries, (unsigned long)stats.busy, stats.fatWalks, stats.cancels,
+		stats.flushes, stats.saves);
+}
+#else
+#define printStats()
+#endif
+
+static unsigned char latch, field[11];
+static unsigned short fields;			// sectors with a good address field
+static int fieldTrk, fieldNum = -1;
+
+// the nibbles of the bits sent as the disk controller latches them,
+// address fields of fieldTrk are counted in fields
+static void scanBits(unsigned char c)
+{
+	unsigned char i, v, t, sc;
+
+	for (i=0; i<8; i++) {
+		latch = (unsigned char)((latch<<1)|((c>>(7-i))&1));
+		if (!(latch&0x80)) continue;
+		if (fieldNum>=3) field[fieldNum++] = latch;
+		else if (latch==0xd5) fieldNum = 0, field[fieldNum++] = latch;
+		else if ((fieldNum==1)&&(latch==0xaa)) field[fieldNum++] = latch;
+		else if ((fieldNum==2)&&(latch==0x96)) field[fieldNum++] = latch;
+		else fieldNum = -1;
+		latch = 0;
+		if (fieldNum==11) {
+			v = (unsigned char)(((field[3]<<1)|1)&field[4]);
+			t = (unsigned char)(((field[5]<<1)|1)&field[6]);
+			sc = (unsigned char)(((field[7]<<1)|1)&field[8]);
+			if (((((field[9]<<1)|1)&field[10])==(v^t^sc))&&(t==fieldTrk)&&(sc<16))
+				fields |= (unsigned short)(1<<sc);
+			fieldNum = -1;
+		}
+	}
+}
+
+// n bytes sent by __vector_16 out of readRing, main() keeps filling it
+static void sendBytes(unsigned char *buf, unsigned short n)
+{
+	while (n--) {
+		fillRing();
+		scanBits(*readPtr);
+		*buf++ = *readPtr++;
+		if (readPtr==readRing+RING) readPtr = readRing;
+		bitbyte += 8;
+		if (bitbyte==bitLimit) prepare = 1;
+	}
+}
+
+// the head lands on a sector, the ring is filled again from it
+static void seekSector(unsigned char trk, unsigned char sc)
+{
+	ph_track = (unsigned char)(trk*4);
+	cancelRead();
+	if (woz) wozTrack(ph_track);
+	sector = sc;
+	fieldTrk = trk;
+	fields = 0;
+}
+
+// RWTS stepping a half track at a time, the next phase goes on before
+// the last one goes off, each change is handed to the PCINT0 handler
+static void stepTo(unsigned char trk)
+{
+	unsigned char ph = (unsigned char)(ph_track>>1);
+
+	while (ph != trk*2) {
+		unsigned char next = (unsigned char)((ph<trk*2)?ph+1:ph-1);
+
+		PINB = (unsigned char)((1<<(ph&3))|(1<<(next&3)));
+		__vector_3();
+		PINB = (unsigned char)(1<<(next&3));
+		__vector_3();
+		ph = next;
+	}
+	PINB = 0;
+	__vector_3();
+}
+
+// a sector as __vector_16 sends it
+static void readSector(unsigned char trk, unsigned char sc, unsigned char *buf)
+{
+	seekSector(trk, sc);
+	sendBytes(buf, RING);
+}
+
+#ifdef WRITE_ICP
+// n nibbles written after syncs 10 bit sync bytes, each 1 is a transition
+// on WRITE handed to the capture handler, the cells are off by ppm; the
+// first one comes 12 cells after WRITE REQUEST, and main() has not taken
+// the capture yet
+static void fluxCapture(const unsigned char *nib, unsigned short n, unsigned char syncs,
+	long ppm)
+{
+	unsigned long t = 1000, cell = ICP_CELL*(1000000UL+ppm)/1000000UL;
+	unsigned short i;
+	unsigned char b, k;
+
+	TCNT1 = (unsigned short)t;
+	wreq = 0;
+	__vector_1();
+	t += 11*cell;
+	for (i=0; i<syncs+n; i++) {
+		b = (i<syncs)?0xff:nib[i-syncs];
+		for (k=0; k<((i<syncs)?10:8); k++, b = (unsigned char)(b<<1)) {
+			t += cell;
+			if ((k<8) && (b&0x80) && TIMSK1) {
+				ICR1 = (unsigned short)t;
+				ACSR ^= (1<<ACO);
+				__vector_10();
+			}
+		}
+	}
+	wreq = 0x04;
+	__vector_1();
+}
+
+static void fluxWrite(const unsigned char *nib, unsigned short n, unsigned char syncs,
+	long ppm)
+{
+	fluxCapture(nib, n, syncs, ppm);
+	icpTake();
+}
+
+static int flushArmed;
+static unsigned long flushCmd17, flushCmd24;
+
+// DOS writing while a DSK block goes back: at the first CMD24 after a
+// CMD17 past the first CMD24 of the flush, the other half of the block
+// is in readData then; the capture starts only if INT0 is not masked
+static void flushWrite(void)
+{
+	static unsigned char nib[349];
+	unsigned short i;
+
+	if (!flushArmed || (sdStats.cmds[24]==flushCmd24)) return;
+	if ((flushArmed==1) || (sdStats.cmds[17]==flushCmd17)) {
+		flushArmed = 2;
+		flushCmd17 = sdStats.cmds[17];
+		flushCmd24 = sdStats.cmds[24];
+		return;
+	}
+	flushArmed = 0;
+	if (!(EIMSK & (1<<INT0))) return;
+	nib[0] = 0xd5;
+	nib[1] = 0xaa;
+	nib[2] = 0xad;
+	for (i=3; i<349; i++) nib[i] = 0xff;
+	fluxCapture(nib, 349, 5, 0);
+}
+#endif
+
+// DOS writing sector sc of track trk with the 256 bytes at src, right
+// after its address field; the host's clock is off by up to 2% by sector
+static void writeSector(unsigned char trk, unsigned char sc, const unsigned char *src)
+{
+	static unsigned char buf[0x38], enc[349];
+
+	seekSector(trk, sc);
+	sendBytes(buf, 0x38);
+#ifdef WRITE_ICP
+	enc[0] = 0xd5;
+	enc[1] = 0xaa;
+	enc[2] = 0xad;
+	encode62(enc+3, (unsigned char *)src);
+	enc[346] = 0xde;
+	enc[347] = 0xaa;
+	enc[348] = 0xeb;
+	fluxWrite(enc, 349, 5, ((long)((sc+2)%3)-1)*20000);
+#else
+	(void)enc;
+	writePtr[0] = 0xd5;
+	writePtr[1] = 0xaa;
+	writePtr[2] = 0xad;
+	encode62(writePtr+3, (unsigned char *)src);
+	writePtr[346] = 0xde;
+	writePtr[347] = 0xaa;
+	writePtr[348] = 0xeb;
+	writeBack();
+#endif
+	if (restart) restartRead();
+}
+
+// a switch command as an Apple II utility sends it: from the phase the
+// head rests on, every bit through all four phases on, and back
+static void sendSwitch(unsigned char arg)
+{
+	unsigned short cmd = (unsigned short)((SWITCH_KEY<<8)|arg);
+	unsigned char rest = (unsigned char)(1<<((ph_track>>1)&3)), k;
+
+	PINB = rest;
+	__vector_3();
+	for (k=0; k<16; k++, cmd = (unsigned short)(cmd<<1)) {
+		PINB = 0b00001111;
+		__vector_3();
+		PINB = ((cmd&0x8000)?0b00001010:0b00000101);
+		__vector_3();
+	}
+	PINB = 0b00001111;
+	__vector_3();
+	PINB = rest;
+	__vector_3();
+	PINB = 0;
+	__vector_3();
+}
+
+// a packet from the host to dest as __vector_1 captures it, from the
+// packet begin mark on
+static void hostPacket(unsigned char dest, unsigned char type, const unsigned char *src,
+	unsigned short n)
+{
+	unsigned char *p = writeData, chk = 0, odd = (unsigned char)(n%7), k, j, m;
+	unsigned short i;
+
+	*p++ = 0xc3;
+	*p++ = (unsigned char)(dest|0x80);
+	*p++ = 0x80;
+	*p++ = type;
+	*p++ = 0x80;
+	*p++ = 0x80;
+	*p++ = (unsigned char)(odd|0x80);
+	*p++ = (unsigned char)((n/7)|0x80);
+	for (i=1; i<8; i++) chk ^= writeData[i];
+	for (i=0; i<n; i = (unsigned short)(i+k)) {
+		k = (unsigned char)((i||!odd)?7:odd);
+		for (m=0x80, j=0; j<k; j++) {
+			m = (unsigned char)(m|((src[i+j]&0x80)>>(1+j)));
+			chk ^= src[i+j];
+		}
+		*p++ = m;
+		for (j=0; j<k; j++) *p++ = (unsigned char)(src[i+j]|0x80);
+	}
+	*p++ = (unsigned char)(chk|0xaa);
+	*p++ = (unsigned char)((chk>>1)|0xaa);
+	*p++ = 0xc8;
+}
+
+// the response of len bytes in writeData is a packet to the host of the
+// given type and status, n bytes of content go to dst
+static int hostReply(unsigned short len, unsigned char type, unsigned char stat,
+	unsigned char *dst, unsigned short n)
+{
+	static const unsigned char sync[6] = {0xff,0x3f,0xcf,0xf3,0xfc,0xff};
+	unsigned char *p = writeData+7, chk = 0, odd = (unsigned char)(n%7), k, j, m;
+	unsigned short i;
+
+	if ((len!=6+8+n+(n+6)/7+3)||memcmp(writeData, sync, 6)||(writeData[6]!=0xc3)) return 0;
+	for (i=6; i<len; i++) if (!(writeData[i]&0x80)) return 0;
+	if ((p[0]!=0x80)||(p[1]!=(spId|0x80))||(p[2]!=type)||(p[4]!=(stat|0x80))||
+		(p[5]!=(odd|0x80))||(p[6]!=((n/7)|0x80))) return 0;
+	for (i=0; i<7; i++) chk ^= p[i];
+	p += 7;
+	for (i=0; i<n; i = (unsigned short)(i+k)) {
+		k = (unsigned char)((i||!odd)?7:odd);
+		m = *p++;
+		for (j=0; j<k; j++) {
+			dst[i+j] = (unsigned char)((*p++&0x7f)|((m<<(1+j))&0x80));
+			chk ^= dst[i+j];
+		}
+	}
+	return ((p[0]==(chk|0xaa))&&(p[1]==((chk>>1)|0xaa))&&(p[2]==0xc8));
+}
+
+// a SmartPort command to unit 1 with a block number or a status code
+static unsigned short hostCommand(unsigned char cmd, unsigned short bn)
+{
+	unsigned char c[9] = {0};
+
+	c[0] = cmd;
+	c[1] = 3;
+	c[4] = (unsigned char)bn;
+	c[5] = (unsigned char)(bn>>8);
+	hostPacket(1, 0x80, c, 9);
+	return spTake(0)?spExec(0):0xffff;
+}
+
+// the SmartPort operations on a block image
+static int spBench(int sdhc)
+{
+	static unsigned char blk[3][512], got[512], st[25];
+	unsigned short bn = (unsigned short)(spBlocks/2), j;
+	unsigned char i;
+	int ok = 1;
+
+	if (!hostReply(hostCommand(5, 0), 0x81, 0x7f, st, 0)||(spId!=1)) ok = 0;
+	report("init");
+	if (!hostReply(hostCommand(0, 0), 0x81, 0, st, 4)||(st[0]!=(protect?0xfc:0xf8))||
+		(st[1]+st[2]*256!=spBlocks)||!spBlocks) ok = 0;
+	if (!hostReply(hostCommand(0, 3), 0x81, 0, st, 25)||memcmp(st+5, "SDISK II", 8)) ok = 0;
+	report("status");
+	for (i=0; i<3; i++)
+		if (!hostReply(hostCommand(1, (unsigned short)(bn-1+i)), 0x82, 0, blk[i], 512)) ok = 0;
+	// a block of a 2MG image spans two sectors
+	i = (spOfs?6:3);
+	if (sdStats.cmds[17]-last.cmds[17]>i+walkReads(i)) ok = 0;
+	report("read");
+	for (j=0; j<512; j++) blk[1][j] = (unsigned char)(j*13+5);
+	if (hostCommand(2, bn)!=0) ok = 0;
+	hostPacket(1, 0x82, blk[1], 512);
+	if (!spTake(1)||!hostReply(spExec(1), 0x81, protect?0x2b:0, st, 0)) ok = 0;
+	report("write");
+	for (i=0; i<3; i++) {
+		if (!hostReply(hostCommand(1, (unsigned short)(bn-1+i)), 0x82, 0, got, 512)) ok = 0;
+		if (((i!=1)||!protect)&&memcmp(got, blk[i], 512)) ok = 0;
+	}
+	report("verify");
+	if (!hostReply(hostCommand(1, spBlocks), 0x81, 0x2d, st, 0)) ok = 0;
+	hostPacket(2, 0x80, st, 9);
+	if (spTake(0)) ok = 0;
+	st[0] = 1;
+	hostPacket(1, 0x80, st, 9);
+	writeData[9] ^= 0x01;
+	if (spTake(0)) ok = 0;
+	report("errors");
+	printStats();
+	printf("block image, %s, SmartPort %s\n", sdhc?"SDHC":"SDSC", ok?"ok":"MISMATCH");
+	return ok;
+}
+
+// root directory sectors in use, up to the first entry never used,
+// straight from the image file
+static unsigned long rootUsed(const char *path)
+{
+	unsigned char e[32];
+	unsigned long n = 0;
+	unsigned short i;
+	FILE *f = fopen(path, "rb");
+
+	if (!f) return 0;
+	for (i=0; i<512; i++) {
+		if (fseek(f, (long)(rootAddr*512+i*32UL), SEEK_SET) ||
+			(fread(e, 32, 1, f)!=1) || !e[0]) break;
+		if (!(i&0xf)) n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: hostbench [-c] [-n nac] [-b busy] [-t track] disk.img\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char buf[RING], src[256], enc[349], keep[16][343];
+	int opt, sdhc = 0, targetTrack = 17, ok = 1;
+	unsigned char i, num, sc;
+	unsigned short j, idx, ft;
+	unsigned long reads, sec;
+
+	while ((opt = getopt(argc, argv, "cn:b:t:"))!=-1) {
+		switch (opt) {
+		case 'c': sdhc = 1; break;
+		case 'n': sdNac = (unsigned short)atoi(optarg); break;
+		case 'b': sdBusy = (unsigned short)atoi(optarg); break;
+		case 't': targetTrack = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if ((argc-optind)!=1) usage();
+	if ((targetTrack<1)||(targetTrack>34)) usage();
+	if (!sdOpen(argv[optind], sdhc)) {
+		fprintf(stderr, "hostbench: can't open %s\n", argv[optind]);
+		return 2;
+	}
+
+	printf("operation  CMD17 CMD18 CMD12 CMD24 CMD25 other    bytes   busy   wait  read write\n");
+	memset(enc, 0xff, sizeof(enc));
+	eeprom_update_block((const void *)enc, (void *)&eeMount, sizeof(eeMount));
+	eeprom_update_block((const void *)enc, (void *)&eeCatIndex, 2);
+	init();
+	report("mount");
+	if (!inited) {
+		printf("no image found\n");
+		sdClose();
+		return 1;
+	}
+	eeprom_read_block((void *)&j, (const void *)&eeCatIndex, 2);
+	if ((catCluster>=2)&&j) ok = 0;
+	memcpy(src, imgExtFt, 2*EXT_NUM);
+	reads = sdStats.blocksRead;
+	init();
+	report("remount");
+	// the BPB, the directory entry and the root directory in use are
+	// read, and TMAP and TRKS for the track under the head of a WOZ
+	// image; the map is the same
+	if (!inited||(sdStats.blocksRead-reads>((dirAddr==rootAddr)?1u:2u)+
+		rootUsed(argv[optind])+(woz?2u:0u))||
+		memcmp(src, imgExtFt, 2*EXT_NUM)) ok = 0;
+#ifdef STATS
+	// as when the drive is turned off, the file holds them after
+	saveStats();
+	report("stats");
+	if ((statsDir!=512)&&(stats.saves!=1)) ok = 0;
+#endif
+	// the drive holds the cache off, writeSD() goes through it
+	cacheClear(0);
+	j = (smartPort?blkDir:(woz?wozDir:(dskMode?dskDir:nicDir)));
+	sec = dirAddr+(j>>4);
+	j = (unsigned short)((j&0xf)*32+26);
+	memcpy(&ft, readCache(sec)+j, 2);
+	ft++;
+	writeSD(sec, j, (unsigned char *)&ft, 2);
+	reads = sdStats.blocksRead;
+	init();
+	report("rewrite");
+	if (sdStats.blocksRead-reads<=(woz?4u:2u)) ok = 0;
+	ft--;
+	cacheClear(0);
+	writeSD(sec, j, (unsigned char *)&ft, 2);
+	eeprom_update_byte(&eeMount.magic, 0);
+	init();
+	report("restore");
+	if (!inited||memcmp(src, imgExtFt, 2*EXT_NUM)) ok = 0;
+	// another image of the same kind copied on the card since
+	idx = (smartPort?blkDir:(woz?wozDir:(dskMode?dskDir:nicDir)));
+	cacheClear(0);
+	memcpy(enc, readCache(dirAddr+(idx>>4))+(idx&0xf)*32, 32);
+	for (j=0; (j<512)&&readCache(rootAddr+(j>>4))[(j&0xf)*32]; j++) ;
+	if (j<512) {
+		ft = (unsigned short)(*(unsigned short *)(enc+24)+1);
+		memcpy(enc+24, &ft, 2);
+		writeSD(rootAddr+(j>>4), (unsigned short)((j&0xf)*32), enc, 32);
+		sc = (unsigned char)(dirAddr==rootAddr);
+		init();
+		ft = (smartPort?blkDir:(woz?wozDir:(dskMode?dskDir:nicDir)));
+		if (!inited||(ft!=(sc?j:idx))) ok = 0;
+		cacheClear(0);
+		enc[0] = 0;
+		writeSD(rootAddr+(j>>4), (unsigned short)((j&0xf)*32), enc, 1);
+		eeprom_update_byte(&eeMount.magic, 0);
+		init();
+		ft = (smartPort?blkDir:(woz?wozDir:(dskMode?dskDir:nicDir)));
+		if (!inited||(ft!=idx)) ok = 0;
+	}
+	report("newer");
+	if (smartPort) {
+		ok = (spBench(sdhc)&&ok);
+		sdClose();
+		return ok?0:1;
+	}
+	// the scan goes through the metadata cache, which shares writeData
+	cacheClear(0);
+	findExt(woz?"WOZ":(dskMode?"DSK":"NIC"), &protect, (unsigned char *)0);
+	cacheClear(1);
+	report("findExt");
+	seekSector(0, 0);
+	for (sc=0; sc<16; sc++) sendBytes(buf, RING);
+	if (fields!=0xffff) ok = 0;
+	report("track");
+	stepTo((unsigned char)targetTrack);
+	if (ph_track!=targetTrack*4) ok = 0;
+	readSector((unsigned char)targetTrack, 0, buf);
+	// a WOZ track goes on from where the head was, a whole sector may
+	// take longer than RING bytes
+	if (woz) sendBytes(buf, RING);
+	if (!fields) ok = 0;
+	if (sdStats.cmds[17]-last.cmds[17]>((dskMode||woz)?2u:0u)+walkReads(2)) ok = 0;
+	report("seek");
+	if (woz) {
+		printStats();
+		printf("WOZ%d image, %s, track read %s\n", woz, sdhc?"SDHC":"SDSC", ok?"ok":"MISMATCH");
+		sdClose();
+		return ok?0:1;
+	}
+
+	// the sectors DOS writes in a row, each after its address field is
+	// read, captured as __vector_1 does and handed to writeBack(); main()
+	// writes them back when the last buffer is taken, a DSK image keeps
+	// the last buffer for reading
+	num = BUF_FULL;
+	for (sc=0; sc<16; sc++) {
+		if ((sc<1)||(sc>num)) {
+			readSector((unsigned char)targetTrack, sc, buf);
+			memcpy(keep[sc], buf+0x38, 343);
+		}
+	}
+#ifdef WRITE_ICP
+	flushArmed = 1;
+	flushCmd24 = sdStats.cmds[24];
+#endif
+	for (i=0; i<num; i++) {
+		for (j=0; j<256; j++) src[j] = (unsigned char)(i*37+j*7+1);
+		writeSector((unsigned char)targetTrack, i+1, src);
+	}
+#ifdef WRITE_ICP
+	flushArmed = 0;
+	// main() takes a write that came in during the flush
+	if (writeDone) icpTake();
+#endif
+	if (sectors[0]!=0xff) ok = 0;
+	report("flush");
+	for (sc=0; sc<16; sc++) {
+		readSector((unsigned char)targetTrack, sc, buf);
+		if ((sc<1)||(sc>num)) {
+			if (memcmp(buf+0x38, keep[sc], 343)) ok = 0;
+			continue;
+		}
+		for (j=0; j<256; j++) src[j] = (unsigned char)((sc-1)*37+j*7+1);
+		// the data field starts 3 bytes before the end of the header
+		if (buf[0x35]!=0xd5) ok = 0;
+		encode62(enc, src);
+		if (memcmp(buf+0x38, enc, 343)) ok = 0;
+	}
+	report("verify");
+
+	// DOS reads a sector again right after writing it
+	for (j=0; j<256; j++) src[j] = (unsigned char)(j*11+5);
+	writeSector((unsigned char)targetTrack, num+1, src);
+	reads = sdStats.blocksWritten;
+	readSector((unsigned char)targetTrack, num+1, buf);
+	encode62(enc, src);
+	if ((sdStats.blocksWritten!=reads)||(sectors[0]==0xff)||
+		(buf[0x35]!=0xd5)||memcmp(buf+0x38, enc, 343)) ok = 0;
+	report("reread");
+
+	// the sector buffered goes back to its image before the switch
+	eeprom_read_block((void *)&idx, (const void *)&eeCatIndex, 2);
+	sendSwitch(SWITCH_NEXT);
+	if (!switchCmd) ok = 0;
+	switchImage();
+	if (sectors[0]!=0xff) ok = 0;
+	// from a catalog: the sector written back, the catalog header and the
+	// record, the image's entry and its FAT, and the BPB and the entry
+	// again for the mount entry
+	if (inited&&(catCluster>=2)&&(sdStats.cmds[17]-last.cmds[17]>6+mapReads())) ok = 0;
+	report("switch");
+	if (inited) {
+		eeprom_read_block((void *)&j, (const void *)&eeCatIndex, 2);
+		if (j==idx) ok = 0;
+		sendSwitch(SWITCH_PREV);
+		switchImage();
+	}
+	if (!inited) init();
+	eeprom_read_block((void *)&j, (const void *)&eeCatIndex, 2);
+	if (!inited||(j!=idx)) ok = 0;
+	if ((catCluster>=2)&&!idx) {
+		sendSwitch(SWITCH_PREV);
+		switchImage();
+		cacheClear(0);
+		memcpy(&ft, readCache(userAddr+((unsigned long)(catCluster-2)<<sectorsPerCluster2))+10, 2);
+		eeprom_read_block((void *)&j, (const void *)&eeCatIndex, 2);
+		if (!inited||(j!=ft-1)) ok = 0;
+		sendSwitch(SWITCH_NEXT);
+		switchImage();
+		eeprom_read_block((void *)&j, (const void *)&eeCatIndex, 2);
+		if (!inited||j) ok = 0;
+	}
+	for (j=0; j<256; j++) src[j] = (unsigned char)(j*11+5);
+	readSector((unsigned char)targetTrack, num+1, buf);
+	encode62(enc, src);
+	if (memcmp(buf+0x38, enc, 343)) ok = 0;
+	report("back");
+
+	// DOS leaves the drive on with nothing to do, later it turns it off
+	for (j=0; j<256; j++) src[j] = (unsigned char)(j*13+3);
+	writeSector((unsigned char)targetTrack, num+2, src);
+	for (j=1; j<FLUSH_TICKS; j++) {
+		TIFR2 = (1<<TOV2);
+		idleFlush();
+	}
+	if (sectors[0]==0xff) ok = 0;
+	TIFR2 = (1<<TOV2);
+	idleFlush();
+	// with FLUSH_IDLE 0 it waits for the drive to be turned off
+	if ((sectors[0]==0xff) != (FLUSH_IDLE!=0)) ok = 0;
+	TIFR2 = 0;
+	for (j=0; j<256; j++) src[j] = (unsigned char)(j*17+9);
+	writeSector((unsigned char)targetTrack, num+3, src);
+	idleFlush();
+	if (sectors[0]==0xff) ok = 0;
+	PINC = 0x01;
+	idleFlush();
+	PINC = 0;
+	if (sectors[0]!=0xff) ok = 0;
+	for (i=2; i<4; i++) {
+		for (j=0; j<256; j++) src[j] = (unsigned char)(j*((i==2)?13:17)+((i==2)?3:9));
+		readSector((unsigned char)targetTrack, num+i, buf);
+		encode62(enc, src);
+		if (memcmp(buf+0x38, enc, 343)) ok = 0;
+	}
+	report("idle");
+	printStats();
+	printf("%s image, %s, write back %s\n", dskMode?"DSK":"NIC", sdhc?"SDHC":"SDSC",
+		ok?"ok":"MISMATCH");
+	sdClose();
+	return ok?0:1;
+}
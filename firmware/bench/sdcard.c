@@ -0,0 +1,259 @@
+/*------------------------------------------------------
+
+	SD card model for the SDISK II test bench
+
+------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include "sdcard.h"
+
+#define QUEUE 2048
+
+struct sdStats sdStats;
+unsigned short sdNac = 1;
+unsigned short sdBusy = 4;
+
+static FILE *img;
+static int hc;								// block addressed
+static unsigned char port;					// the last PORTD value
+static int bitNum, outBit = 1;
+static unsigned char inByte, outByte = 0xff;
+// bytes waiting to be clocked out, and what they are
+enum { DATA, BUSY, WAIT };
+static unsigned char queue[QUEUE], kind[QUEUE];
+static unsigned int qHead, qTail;
+static unsigned char cmd[6];
+static int cmdNum;
+// 0: command, 1: wait a write token, 2: write data, 3: multiple block read
+static int state;
+static int multi, app, idle = 1, acmd41;
+static unsigned long blockLen = 512, writeAdr, readAdr;
+static unsigned char writeBuf[514];
+static int writeNum;
+
+static void pushKind(unsigned char c, unsigned char k)
+{
+	kind[qTail%QUEUE] = k;
+	queue[qTail++%QUEUE] = c;
+}
+
+static void push(unsigned char c)
+{
+	pushKind(c, DATA);
+}
+
+static void pushBusy(void)
+{
+	unsigned short i;
+	for (i=0; i<sdBusy; i++) pushKind(0x00, BUSY);
+	push(0xff);
+}
+
+// queue a data block, it is read from the image as it is
+static void pushBlock(unsigned long adr, unsigned long len)
+{
+	unsigned char buf[512];
+	unsigned long i;
+
+	memset(buf, 0, sizeof(buf));
+	fseek(img, (long)adr, SEEK_SET);
+	if (fread(buf, 1, len, img) != len) memset(buf, 0, sizeof(buf));
+	for (i=0; i<sdNac; i++) pushKind(0xff, WAIT);
+	push(0xfe);
+	for (i=0; i<len; i++) push(buf[i]);
+	push(0x00);
+	push(0x00);	// CRC, not checked by the firmware
+	sdStats.blocksRead++;
+}
+
+static unsigned long cmdArg(void)
+{
+	return ((unsigned long)cmd[1]<<24)|((unsigned long)cmd[2]<<16)|
+		((unsigned long)cmd[3]<<8)|cmd[4];
+}
+
+static unsigned long cmdAdr(void)
+{
+	return hc?(cmdArg()*512):cmdArg();
+}
+
+static void command(void)
+{
+	int c = (cmd[0]&0x3f), a = app;
+
+	app = 0;
+	sdStats.cmds[c]++;
+	push(0xff);	// NCR
+	switch (c) {
+	case 0:
+		idle = 1;
+		acmd41 = 0;
+		push(0x01);
+		return;
+	case 8:
+		if (!hc) {
+			push(0x05);	// version 1 cards do not know command 8
+			return;
+		}
+		push(0x01); push(0x00); push(0x00); push(0x01); push(cmd[4]);
+		return;
+	case 55:
+		app = 1;
+		push(idle?0x01:0x00);
+		return;
+	case 58:
+		push(idle?0x01:0x00);
+		push(hc?0xc0:0x80); push(0xff); push(0x80); push(0x00);
+		return;
+	}
+	if (a && (c==41)) {
+		// SDHC cards stay idle unless the host supports them
+		if ((hc && !(cmd[1]&0x40)) || (++acmd41<3)) push(0x01);
+		else {
+			idle = 0;
+			push(0x00);
+		}
+		return;
+	}
+	if (idle) {
+		push(0x05);
+		return;
+	}
+	if (a && (c==23)) {
+		push(0x00);
+		return;
+	}
+	switch (c) {
+	case 16:
+		blockLen = cmdArg();
+		push((hc && (blockLen!=512))?0x40:0x00);
+		return;
+	case 17:
+		push(0x00);
+		pushBlock(cmdAdr(), hc?512:blockLen);
+		return;
+	case 18:
+		push(0x00);
+		readAdr = cmdAdr();
+		pushBlock(readAdr, 512);
+		readAdr += 512;
+		state = 3;
+		return;
+	case 12:
+		// drop the rest of the stream, then stuff byte, R1 and busy
+		state = 0;
+		qHead = qTail;
+		push(0xff);
+		push(0x00);
+		pushBusy();
+		return;
+	case 24:
+	case 25:
+		push(0x00);
+		writeAdr = cmdAdr();
+		multi = (c==25);
+		state = 1;
+		return;
+	}
+	push(0x04);	// illegal command
+}
+
+static void received(unsigned char c)
+{
+	sdStats.bytes++;
+	switch (state) {
+	case 3:
+		// a multiple block read goes on until command 12
+		if (c==(0x40+12)) {
+			cmd[0] = c;
+			cmdNum = 1;
+			state = 0;
+		} else if (qHead==qTail) {
+			pushBlock(readAdr, 512);
+			readAdr += 512;
+		}
+		return;
+	case 1:
+		if ((c==0xfe) && !multi) state = 2;
+		else if ((c==0xfc) && multi) state = 2;
+		else if ((c==0xfd) && multi) {
+			state = 0;
+			push(0xff);
+			pushBusy();
+		}
+		writeNum = 0;
+		return;
+	case 2:
+		writeBuf[writeNum++] = c;
+		if (writeNum==514) {
+			fseek(img, (long)writeAdr, SEEK_SET);
+			fwrite(writeBuf, 1, 512, img);
+			fflush(img);
+			sdStats.blocksWritten++;
+			writeAdr += 512;
+			push(0x05);	// data accepted
+			pushBusy();
+			state = (multi?1:0);
+		}
+		return;
+	}
+	if (cmdNum==0) {
+		if ((c&0xc0)==0x40) cmd[cmdNum++] = c;
+		return;
+	}
+	cmd[cmdNum++] = c;
+	if (cmdNum==6) {
+		cmdNum = 0;
+		command();
+	}
+}
+
+int sdOpen(const char *path, int sdhc)
+{
+	img = fopen(path, "r+b");
+	hc = sdhc;
+	memset(&sdStats, 0, sizeof(sdStats));
+	return (img!=0);
+}
+
+void sdClose(void)
+{
+	if (img) fclose(img);
+	img = 0;
+}
+
+int sdPortd(unsigned char v)
+{
+	unsigned char old = port;
+
+	port = v;
+	if (v&0x02) {	// deselected
+		bitNum = 0;
+		outBit = 1;
+		return outBit;
+	}
+	if (old&0x02) bitNum = 0;
+	if (!(old&0x20) && (v&0x20)) {	// CLK rising edge
+		if (bitNum==0) {
+			if (qHead==qTail) outByte = 0xff;
+			else {
+				if (kind[qHead%QUEUE]==BUSY) sdStats.busy++;
+				if (kind[qHead%QUEUE]==WAIT) sdStats.wait++;
+				outByte = queue[qHead++%QUEUE];
+			}
+		}
+		outBit = ((outByte>>(7-bitNum))&1);
+		inByte = ((inByte<<1)|((v>>4)&1));
+		if (++bitNum==8) {
+			bitNum = 0;
+			received(inByte);
+		}
+	}
+	return outBit;
+}
+
+int sdDo(void)
+{
+	return outBit;
+}
@@ -0,0 +1,53 @@
+/*------------------------------------------------------
+
+	SD card model for the SDISK II test bench
+
+------------------------------------------------------*/
+
+/*
+the card is driven through the same PORTD pins as the firmware uses:
+
+	D0: DO (card output)
+	D1: CS
+	D4: DI
+	D5: CLK
+
+sdPortd() is called with the new PORTD value on every write and returns
+the DO level, which the firmware samples after raising CLK.
+the card is backed by a raw image file (a FAT16 volume with or without
+an MBR), addressed in bytes (SDSC) or in sectors (SDHC).
+*/
+
+#ifndef SDCARD_H
+#define SDCARD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// command and transfer counters
+struct sdStats {
+	unsigned long cmds[64];			// commands received by index
+	unsigned long bytes;			// bytes clocked
+	unsigned long busy;				// busy bytes clocked after a write or CMD12
+	unsigned long wait;				// 0xff bytes clocked before a data token
+	unsigned long blocksRead, blocksWritten;
+};
+
+extern struct sdStats sdStats;
+extern unsigned short sdNac;		// 0xff bytes before each data token
+extern unsigned short sdBusy;		// busy bytes after each written block
+
+// open the image, sdhc selects block addressing
+int sdOpen(const char *path, int sdhc);
+void sdClose(void);
+// a PORTD write, returns DO
+int sdPortd(unsigned char v);
+// the current DO level
+int sdDo(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
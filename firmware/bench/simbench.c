@@ -0,0 +1,441 @@
+/*------------------------------------------------------
+
+	SDISK II test bench on simavr
+
+------------------------------------------------------*/
+
+/*
+runs the linked firmware (sdisk2.elf) on a simulated ATMEGA328P with
+an SD card model (sdcard.c) backed by a FAT16 image, and an Apple II
+side that drives PHASE-0..3, DRIVE ENABLE, WRITE REQUEST and WRITE,
+and decodes the nibbles on READ PULSE.
+
+the bench goes through these steps and reports each of them:
+
+	boot		card inserted and drive enabled at cycle 0, until the
+				first sector with a good address and data field
+	throughput	good sectors per second on track 0
+	seek		half-track steps to the target track, the response is
+				the time from the last phase change to the first
+				address field of the target track
+	write		a data field is written after an address field of the
+				target track, then read back and compared
+
+the bit cell jitter is measured on every READ PULSE edge against the
+4 us cell, gaps longer than a nibble are not counted.
+
+usage: simbench [-c] [-n nac] [-b busy] [-s sectors] [-t track] sdisk2.elf disk.img
+	-c			SDHC card (block addressing)
+	-n nac		0xff bytes before each data token (default 1)
+	-b busy		busy bytes after each written block (default 4)
+	-s sectors	sectors counted for the throughput (default 64)
+	-t track	target track of the seek (default 17)
+
+untested: this bench has not been built against simavr or run on a
+sdisk2.elf yet, so make bench runs hostbench instead.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+#include "sdcard.h"
+
+// the crystal the ELF is built for, bench/Makefile passes it on
+#ifndef F_CPU
+#define F_CPU 27000000UL
+#endif
+#define CELL (F_CPU/250000)				// 4 us bit cell
+#define MS(c) ((double)(c)*1000.0/F_CPU)
+#define LIMIT (F_CPU*20)				// give up after 20 seconds
+
+enum { BOOT, THROUGHPUT, SEEK, SETTLE, WRITE, VERIFY, DONE };
+
+static avr_t *avr;
+static avr_irq_t *doIrq, *phaseIrq[4], *enableIrq, *writeIrq, *wreqIrq, *ejectIrq;
+static unsigned char portd;
+static int step = BOOT;
+
+// options
+static int sectorNum = 64, targetTrack = 17;
+
+// results
+static avr_cycle_count_t firstSector, tputStart, tputEnd, stepEnd, seekDone;
+static avr_cycle_count_t writeEnd, verifyDone, longestGap;
+static int tputCount, writeOk;
+static unsigned long pulses;
+static long jitterMax;
+static double jitterSum;
+
+// nibble decoder
+static avr_cycle_count_t lastPulse;
+static unsigned char shift;
+static unsigned char window[3];
+static int field, fieldLen;				// 1: address, 2: data
+static unsigned char fieldData[343];
+static int addrTrack = -1, addrSector = -1;
+
+// head
+static int halfTrack;
+static unsigned char writeSector;
+
+// writer
+static unsigned char writeBits[(5*10+(3+343+3+1)*8)];
+static int writeBitNum, writeBitPos;
+static unsigned char writeLevel;
+static unsigned char pattern[256];
+
+static const unsigned char encTable[64] = {
+	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
+	0xA7,0xAB,0xAC,0xAD,0xAE,0xAF,0xB2,0xB3,
+	0xB4,0xB5,0xB6,0xB7,0xB9,0xBA,0xBB,0xBC,
+	0xBD,0xBE,0xBF,0xCB,0xCD,0xCE,0xCF,0xD3,
+	0xD6,0xD7,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,
+	0xDF,0xE5,0xE6,0xE7,0xE9,0xEA,0xEB,0xEC,
+	0xED,0xEE,0xEF,0xF2,0xF3,0xF4,0xF5,0xF6,
+	0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
+};
+static unsigned char decTable[256];
+static const unsigned char flip[4] = { 0, 2, 1, 3 };
+
+// 6-and-2 encode 256 bytes into 342 nibbles and a checksum
+static void encode62(unsigned char *dst, const unsigned char *src)
+{
+	unsigned char x, ox = 0;
+	int i;
+
+	for (i=0; i<86; i++) {
+		x = (flip[src[i]&3] | (flip[src[i+86]&3]<<2) |
+			((i<=83)?(flip[src[i+172]&3]<<4):0));
+		dst[i] = encTable[x^ox];
+		ox = x;
+	}
+	for (i=0; i<256; i++) {
+		x = (src[i]>>2);
+		dst[i+86] = encTable[x^ox];
+		ox = x;
+	}
+	dst[342] = encTable[ox];
+}
+
+// decode 343 nibbles, returns 0 on a checksum error
+static int decode62(unsigned char *dst, const unsigned char *src)
+{
+	unsigned char v[342], x = 0, a;
+	int i;
+
+	for (i=0; i<342; i++) {
+		x ^= decTable[src[i]];
+		v[i] = x;
+	}
+	if (x!=decTable[src[342]]) return 0;
+	for (i=0; i<256; i++) {
+		a = ((i<86)?v[i]:((i<172)?(v[i-86]>>2):(v[i-172]>>4)));
+		dst[i] = ((v[i+86]<<2)|flip[a&3]);
+	}
+	return 1;
+}
+
+static void startSeek(void);
+static void startWrite(void);
+
+// a good address field
+static void addressField(int trk, int sc)
+{
+	addrTrack = trk;
+	addrSector = sc;
+	if ((step==SETTLE) && (trk==targetTrack)) {
+		seekDone = avr->cycle;
+		step = WRITE;
+		writeSector = (unsigned char)((sc+2)&0xf);
+	} else if ((step==WRITE) && (trk==targetTrack) && (sc==writeSector)) {
+		startWrite();
+	}
+}
+
+// a good data field after a good address field
+static void dataField(int trk, int sc, unsigned char *data)
+{
+	switch (step) {
+	case BOOT:
+		firstSector = avr->cycle;
+		tputStart = avr->cycle;
+		step = THROUGHPUT;
+		break;
+	case THROUGHPUT:
+		if (trk!=0) break;
+		if (++tputCount==sectorNum) {
+			tputEnd = avr->cycle;
+			startSeek();
+		}
+		break;
+	case VERIFY:
+		if ((trk==targetTrack) && (sc==writeSector)) {
+			verifyDone = avr->cycle;
+			writeOk = !memcmp(data, pattern, 256);
+			step = DONE;
+		}
+		break;
+	}
+}
+
+static void nibble(unsigned char n)
+{
+	if (field) {
+		fieldData[fieldLen++] = n;
+		if ((field==1) && (fieldLen==8)) {
+			unsigned char v[4];
+			int i;
+
+			field = 0;
+			for (i=0; i<4; i++) v[i] = (((fieldData[i*2]<<1)|1)&fieldData[i*2+1]);
+			if ((v[0]^v[1]^v[2])==v[3]) addressField(v[1], v[2]);
+		} else if ((field==2) && (fieldLen==343)) {
+			unsigned char data[256];
+
+			field = 0;
+			if ((addrTrack>=0) && decode62(data, fieldData))
+				dataField(addrTrack, addrSector, data);
+			addrTrack = addrSector = -1;
+		}
+		return;
+	}
+	window[0] = window[1];
+	window[1] = window[2];
+	window[2] = n;
+	if ((window[0]==0xd5) && (window[1]==0xaa)) {
+		if (window[2]==0x96) {
+			field = 1;
+			fieldLen = 0;
+			addrTrack = addrSector = -1;
+		} else if (window[2]==0xad) {
+			field = 2;
+			fieldLen = 0;
+		}
+	}
+}
+
+// the disk controller's shift register
+static void readBit(int b)
+{
+	if (!shift && !b) return;
+	shift = (unsigned char)((shift<<1)|b);
+	if (shift&0x80) {
+		nibble(shift);
+		shift = 0;
+	}
+}
+
+// READ PULSE (C1)
+static void readPulse(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	avr_cycle_count_t now = avr->cycle;
+
+	(void)irq; (void)param;
+	if (!value) return;
+	if (lastPulse) {
+		avr_cycle_count_t dt = now-lastPulse;
+		avr_cycle_count_t cells = (dt+CELL/2)/CELL;
+		avr_cycle_count_t i;
+
+		if (cells<=8) {
+			long j = (long)dt-(long)(cells*CELL);
+
+			pulses++;
+			jitterSum += (double)j*j;
+			if (labs(j)>jitterMax) jitterMax = labs(j);
+		} else if (dt>longestGap) longestGap = dt;
+		if (cells>64) cells = 64;	// a gap, the shift register is idle
+		for (i=1; i<cells; i++) readBit(0);
+	}
+	readBit(1);
+	lastPulse = now;
+}
+
+// CS (D1), DI (D4) and CLK (D5) of the SD card
+static void sdPin(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	unsigned char bit = (unsigned char)(uintptr_t)param;
+
+	(void)irq;
+	if (value) portd |= bit;
+	else portd &= ~bit;
+	avr_raise_irq(doIrq, sdPortd(portd));
+}
+
+static void setPhase(int ph)
+{
+	int i;
+	for (i=0; i<4; i++) avr_raise_irq(phaseIrq[i], (i==ph));
+}
+
+// a half-track step every 3 ms, like RWTS
+static avr_cycle_count_t stepTimer(struct avr_t *a, avr_cycle_count_t when, void *param)
+{
+	(void)a; (void)param;
+	halfTrack++;
+	setPhase(halfTrack&3);
+	if (halfTrack==targetTrack*2) {
+		stepEnd = avr->cycle;
+		step = SETTLE;
+		return 0;
+	}
+	return when+F_CPU/1000*3;
+}
+
+static void startSeek(void)
+{
+	step = SEEK;
+	if (targetTrack==0) {
+		stepEnd = avr->cycle;
+		step = SETTLE;
+		return;
+	}
+	avr_cycle_timer_register(avr, 1, stepTimer, NULL);
+}
+
+// one bit cell of the writer, a one toggles WRITE
+static avr_cycle_count_t writeTimer(struct avr_t *a, avr_cycle_count_t when, void *param)
+{
+	(void)a; (void)param;
+	if (writeBitPos==writeBitNum) {
+		avr_raise_irq(wreqIrq, 1);
+		writeEnd = avr->cycle;
+		step = VERIFY;
+		return 0;
+	}
+	if (writeBits[writeBitPos++]) {
+		writeLevel ^= 1;
+		avr_raise_irq(writeIrq, writeLevel);
+	}
+	return when+CELL;
+}
+
+static void putBits(unsigned char c, int n)
+{
+	int i;
+	for (i=0; i<n; i++) writeBits[writeBitNum++] = ((c>>(7-i))&1);
+	for (; i<8; i++) writeBits[writeBitNum++] = 0;
+}
+
+// write a data field with the test pattern right after the address field
+static void startWrite(void)
+{
+	unsigned char nib[343];
+	int i;
+
+	writeBitNum = writeBitPos = 0;
+	for (i=0; i<5; i++) putBits(0xff, 10);	// self sync
+	putBits(0xd5, 8); putBits(0xaa, 8); putBits(0xad, 8);
+	encode62(nib, pattern);
+	for (i=0; i<343; i++) putBits(nib[i], 8);
+	putBits(0xde, 8); putBits(0xaa, 8); putBits(0xeb, 8); putBits(0xff, 8);
+	step = DONE;	// no more address fields are acted on while writing
+	avr_raise_irq(wreqIrq, 0);
+	avr_cycle_timer_register(avr, CELL, writeTimer, NULL);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: simbench [-c] [-n nac] [-b busy] [-s sectors] [-t track] "
+		"sdisk2.elf disk.img\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	elf_firmware_t f;
+	int opt, sdhc = 0, i, state;
+
+	while ((opt = getopt(argc, argv, "cn:b:s:t:"))!=-1) {
+		switch (opt) {
+		case 'c': sdhc = 1; break;
+		case 'n': sdNac = (unsigned short)atoi(optarg); break;
+		case 'b': sdBusy = (unsigned short)atoi(optarg); break;
+		case 's': sectorNum = atoi(optarg); break;
+		case 't': targetTrack = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if ((argc-optind)!=2) usage();
+	if ((targetTrack<0)||(targetTrack>34)) usage();
+
+	for (i=0; i<64; i++) decTable[encTable[i]] = (unsigned char)i;
+	for (i=0; i<256; i++) pattern[i] = (unsigned char)(i*7+3);
+
+	memset(&f, 0, sizeof(f));
+	if (elf_read_firmware(argv[optind], &f)) {
+		fprintf(stderr, "simbench: can't read %s\n", argv[optind]);
+		return 2;
+	}
+	avr = avr_make_mcu_by_name("atmega328p");
+	if (!avr) return 2;
+	avr_init(avr);
+	f.frequency = F_CPU;
+	avr_load_firmware(avr, &f);
+	avr->frequency = F_CPU;
+	if (!sdOpen(argv[optind+1], sdhc)) {
+		fprintf(stderr, "simbench: can't open %s\n", argv[optind+1]);
+		return 2;
+	}
+
+	// SD card on port D
+	doIrq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 0);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 1),
+		sdPin, (void *)(uintptr_t)0x02);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 4),
+		sdPin, (void *)(uintptr_t)0x10);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 5),
+		sdPin, (void *)(uintptr_t)0x20);
+	wreqIrq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 2);
+	ejectIrq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 3);
+	// Apple II disk interface on ports B and C
+	for (i=0; i<4; i++) phaseIrq[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i);
+	enableIrq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), 0);
+	writeIrq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), 2);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), 1),
+		readPulse, NULL);
+
+	avr_raise_irq(doIrq, 1);
+	avr_raise_irq(wreqIrq, 1);		// no write request
+	avr_raise_irq(ejectIrq, 0);		// card inserted
+	avr_raise_irq(enableIrq, 0);	// drive enabled
+	avr_raise_irq(writeIrq, 0);
+	setPhase(0);
+
+	do {
+		state = avr_run(avr);
+		if (avr->cycle>LIMIT) break;
+	} while (!verifyDone && (state!=cpu_Done) && (state!=cpu_Crashed));
+
+	printf("boot to first sector : ");
+	if (firstSector) printf("%.2f ms\n", MS(firstSector));
+	else printf("none\n");
+	printf("sector throughput    : ");
+	if (tputEnd) printf("%.1f sectors/s (%d sectors in %.2f ms)\n",
+		sectorNum/(MS(tputEnd-tputStart)/1000.0), sectorNum, MS(tputEnd-tputStart));
+	else printf("not measured\n");
+	printf("bit cell jitter      : max %ld cycles, rms %.1f ns over %lu pulses\n",
+		jitterMax, pulses?sqrt(jitterSum/pulses)*1e9/F_CPU:0.0, pulses);
+	printf("longest gap          : %.1f us\n", MS(longestGap)*1000.0);
+	printf("stepper response     : ");
+	if (seekDone) printf("%.2f ms (track 0 to %d)\n", MS(seekDone-stepEnd), targetTrack);
+	else printf("not measured\n");
+	printf("write round trip     : ");
+	if (verifyDone) printf("%s, read back %.2f ms after the write\n",
+		writeOk?"ok":"MISMATCH", MS(verifyDone-writeEnd));
+	else printf("not measured\n");
+	printf("SD card              : CMD17 %lu CMD18 %lu CMD12 %lu CMD24 %lu CMD25 %lu, "
+		"%lu bytes, %lu busy, %lu token waits\n",
+		sdStats.cmds[17], sdStats.cmds[18], sdStats.cmds[12], sdStats.cmds[24],
+		sdStats.cmds[25], sdStats.bytes, sdStats.busy, sdStats.wait);
+	sdClose();
+	return (verifyDone && writeOk)?0:1;
+}
@@ -0,0 +1,551 @@
+#!/usr/bin/env python3
+#------------------------------------------------------
+#
+#	cycle budget checker for the SDISK II firmware
+#
+#------------------------------------------------------
+#
+# reads the disassembly of the linked ELF (avr-objdump -d) and computes
+# the fewest and the most cycles of every path through the timing
+# critical code, then checks them against the 4 us bit cell at F_CPU.
+#
+# usage: avr-objdump -d sdisk2.elf | python3 cycles.py F_CPU
+#
+# the paths are walked with the registers, the Z and C flags, the stack
+# and the Y frame tracked as constants where they are known, so counted
+# loops (ldi/dec/brne, cpi/cpc on a counter, lsr of a bit mask) are
+# followed exactly.  a loop whose exit does not depend on anything known,
+# like waiting for the SD card, is taken at most LOOP_BOUNDS[function]
+# times; the card's own latency is not part of any figure.
+#
+# exit status is 1 when a check fails.
+#
+# not yet run on avr-objdump output: the figures for sub.S have been
+# checked against a hand assembled listing, but the C paths (the NIC,
+# DSK and WOZ prepare checks, the writeBack walk, __vector_3 and
+# __vector_10) have no recorded run on a real build, default or
+# WRITE_ICP.  treat a failure there as a lead, not as proof.
+
+import re
+import sys
+import threading
+
+# iterations of a loop that can't be counted, by function
+LOOP_BOUNDS = {
+	'getRespFast': 1,		# the card answers within a byte or two
+	'waitFinish': 1,		# busy time of the card
+	'cmdFast': 1,			# retried commands
+	'waitToken': 7,			# data token wait, the histogram bucket with STATS
+	'readByteFast': 8,
+	'writeByteFast': 8,
+	'sectorAddr': 12,		# EXT_NUM extents
+	'decode62': 342,
+	'encode62': 256,
+	'memcp': 256,
+	'readDsk': 256,
+	'wozSeek': 514,		# the rest of a sector, then the start of the track
+	'writeBack': 1,
+	'__vector_10': 7,		# 0s shifted in before the latch is full
+}
+
+# a loop running longer than this with known registers is not counted
+MAX_ITER = 4096
+
+# interrupt response (4) and the jmp in the vector table (3)
+ENTRY = 7
+
+# the shortest a phase state of a switch command lasts, in us, see
+# SWITCH_KEY in sdisk2.c
+SWITCH_HOLD = 1000
+
+
+class Unbounded(Exception):
+	pass
+
+
+class Retry(Exception):
+	pass
+
+
+class Prog:
+	def __init__(self, lines):
+		self.ins = {}		# address: (mnemonic, operands, size, target)
+		self.syms = {}		# name: address
+		self.funcs = []		# (address, name) of the global symbols
+		for line in lines:
+			m = re.match(r'^([0-9a-f]+) <([^>]+)>:', line)
+			if m:
+				self.syms[m.group(2)] = int(m.group(1), 16)
+				continue
+			m = re.match(r'^\s*([0-9a-f]+):\s+((?:[0-9a-f]{2} )+)\s*([a-z]+)\s*([^;]*)(?:;\s*(.*))?$', line)
+			if not m:
+				continue
+			adr = int(m.group(1), 16)
+			size = len(m.group(2).split())
+			ops = [o.strip() for o in m.group(4).split(',') if o.strip()]
+			target = None
+			c = m.group(5) or ''
+			t = re.match(r'0x([0-9a-f]+)', c)
+			if t:
+				target = int(t.group(1), 16)
+			elif ops and re.match(r'0x[0-9a-f]+$', ops[0]):
+				target = int(ops[0], 16)
+			self.ins[adr] = (m.group(3), ops, size, target)
+		self.addrs = sorted(self.ins)
+
+	def func(self, adr):
+		# the nearest symbol at or before adr that names a function
+		best, name = -1, '?'
+		for n, a in self.syms.items():
+			if a <= adr and a > best and n in self.entries:
+				best, name = a, n
+		return name
+
+
+def reg(op):
+	m = re.match(r'r(\d+)$', op)
+	return int(m.group(1)) if m else None
+
+
+def imm(op):
+	op = op.strip()
+	try:
+		return int(op, 0) & 0xff
+	except ValueError:
+		return None
+
+
+# two cycle instructions, everything not listed is one cycle
+CYCLES = {
+	'adiw': 2, 'sbiw': 2, 'mul': 2, 'muls': 2, 'mulsu': 2, 'fmul': 2,
+	'fmuls': 2, 'fmulsu': 2, 'ld': 2, 'ldd': 2, 'st': 2, 'std': 2,
+	'lds': 2, 'sts': 2, 'push': 2, 'pop': 2, 'rjmp': 2, 'ijmp': 2,
+	'cbi': 2, 'sbi': 2, 'lpm': 3, 'elpm': 3, 'jmp': 3, 'rcall': 3,
+	'icall': 3, 'call': 4, 'ret': 4, 'reti': 4,
+}
+BRANCH = {
+	'breq': ('Z', 1), 'brne': ('Z', 0), 'brcs': ('C', 1), 'brlo': ('C', 1),
+	'brcc': ('C', 0), 'brsh': ('C', 0),
+}
+SKIP = ('sbrc', 'sbrs', 'sbic', 'sbis', 'cpse')
+
+
+class State:
+	# r: 32 known register values or None, z/c: flags, y: Y frame,
+	# stack: pushed values, rets: return addresses, counts: loop counts
+	__slots__ = ('r', 'z', 'c', 'y', 'stack', 'rets', 'counts')
+
+	def __init__(self):
+		self.r = [None]*32
+		self.z = self.c = None
+		self.y = {}
+		self.stack = ()
+		self.rets = ()
+		self.counts = ()
+
+	def copy(self):
+		s = State()
+		s.r = list(self.r)
+		s.z, s.c = self.z, self.c
+		s.y = dict(self.y)
+		s.stack, s.rets, s.counts = self.stack, self.rets, self.counts
+		return s
+
+	def key(self):
+		return (tuple(self.r), self.z, self.c, tuple(sorted(self.y.items())),
+			self.stack, self.rets, self.counts)
+
+	def set(self, d, v):
+		if d is None:
+			return
+		self.r[d] = None if v is None else (v & 0xff)
+		if d in (28, 29):
+			self.y = {}
+
+
+def sub8(a, b, c, s, zchain):
+	# a-b-c with the flags of sub/sbc (zchain: cpc/sbc keep Z)
+	if a is None or b is None or c is None:
+		s.c = None
+		s.z = 0 if (zchain and s.z == 0) else None
+		return None
+	v = a-b-c
+	s.c = 1 if v < 0 else 0
+	z = 1 if (v & 0xff) == 0 else 0
+	s.z = (z & s.z) if zchain and s.z is not None else (None if zchain else z)
+	if zchain and s.z is None and z == 0:
+		s.z = 0
+	return v & 0xff
+
+
+def step(p, adr, s):
+	# successors of an instruction as (address, state, cycles)
+	mn, ops, size, target = p.ins[adr]
+	nxt = adr+size
+	cyc = CYCLES.get(mn, 1)
+	s = s.copy()
+	R = s.r
+	d = reg(ops[0]) if ops else None
+	r = reg(ops[1]) if len(ops) > 1 else None
+	k = imm(ops[1]) if len(ops) > 1 else None
+
+	if mn in BRANCH:
+		flag, val = BRANCH[mn]
+		f = s.z if flag == 'Z' else s.c
+		if f is None:
+			return [(target, s, 2), (nxt, s, 1)]
+		return [(target, s, 2)] if f == val else [(nxt, s, 1)]
+	if mn.startswith('br'):
+		return [(target, s, 2), (nxt, s, 1)]
+	if mn in SKIP:
+		skip = None
+		if mn in ('sbrc', 'sbrs') and R[d] is not None:
+			bit = (R[d] >> int(ops[1])) & 1
+			skip = (bit == 0) if mn == 'sbrc' else (bit == 1)
+		elif mn == 'cpse' and R[d] is not None and R[r] is not None:
+			skip = (R[d] == R[r])
+		over = p.ins[nxt][2]
+		res = []
+		if skip is not False:
+			res.append((nxt+over, s, 2 if over == 2 else 3))
+		if skip is not True:
+			res.append((nxt, s, 1))
+		return res
+	if mn in ('rjmp', 'jmp'):
+		return [(target, s, cyc)]
+	if mn in ('rcall', 'call'):
+		s.rets = s.rets+(nxt,)
+		return [(target, s, cyc)]
+	if mn in ('ret', 'reti'):
+		if not s.rets:
+			return [(None, s, cyc)]
+		ret = s.rets[-1]
+		s.rets = s.rets[:-1]
+		# the loops of the returning call start over on the next call
+		s.counts = tuple(c for c in s.counts if c[0][1] <= len(s.rets))
+		return [(ret, s, cyc)]
+	if mn in ('ijmp', 'icall', 'eijmp', 'eicall'):
+		raise Unbounded('indirect jump at 0x%x' % adr)
+
+	if mn == 'ldi' or mn == 'ser':
+		s.set(d, 0xff if mn == 'ser' else k)
+	elif mn == 'mov':
+		s.set(d, R[r])
+	elif mn == 'movw':
+		s.set(d, R[r])
+		s.set(d+1, R[r+1])
+	elif mn in ('eor', 'and', 'or', 'andi', 'ori', 'sbr', 'cbr'):
+		b = k if mn in ('andi', 'ori', 'sbr', 'cbr') else R[r]
+		if mn == 'eor' and d == r:
+			v = 0
+		elif mn == 'and' and d == r:
+			v = R[d]
+		elif R[d] is None or b is None:
+			v = None
+		elif mn == 'eor':
+			v = R[d] ^ b
+		elif mn in ('and', 'andi'):
+			v = R[d] & b
+		elif mn == 'cbr':
+			v = R[d] & ~b
+		else:
+			v = R[d] | b
+		s.set(d, v)
+		s.z = None if v is None else int(v & 0xff == 0)
+	elif mn == 'clr':
+		s.set(d, 0)
+		s.z = 1
+	elif mn == 'tst':
+		s.z = None if R[d] is None else int(R[d] == 0)
+	elif mn in ('inc', 'dec'):
+		v = None if R[d] is None else (R[d]+(1 if mn == 'inc' else -1)) & 0xff
+		s.set(d, v)
+		s.z = None if v is None else int(v == 0)
+	elif mn in ('subi', 'sbci', 'cpi'):
+		v = sub8(R[d], k, 0 if mn != 'sbci' else s.c, s, mn == 'sbci')
+		if mn != 'cpi':
+			s.set(d, v)
+	elif mn in ('sub', 'sbc', 'cp', 'cpc'):
+		v = sub8(R[d], R[r], 0 if mn in ('sub', 'cp') else s.c, s, mn in ('sbc', 'cpc'))
+		if mn in ('sub', 'sbc'):
+			s.set(d, v)
+	elif mn in ('add', 'adc'):
+		c = 0 if mn == 'add' else s.c
+		if R[d] is None or R[r] is None or c is None:
+			s.set(d, None)
+			s.z = s.c = None
+		else:
+			v = R[d]+R[r]+c
+			s.c = int(v > 0xff)
+			s.set(d, v)
+			s.z = int(v & 0xff == 0)
+	elif mn in ('adiw', 'sbiw'):
+		k = int(ops[1], 0)
+		if R[d] is None or R[d+1] is None:
+			s.set(d, None)
+			s.set(d+1, None)
+			s.z = s.c = None
+		else:
+			w = R[d] | (R[d+1] << 8)
+			w = w+k if mn == 'adiw' else w-k
+			s.c = int(w > 0xffff or w < 0)
+			w &= 0xffff
+			s.set(d, w & 0xff)
+			s.set(d+1, w >> 8)
+			s.z = int(w == 0)
+	elif mn in ('lsl', 'lsr', 'rol', 'ror', 'asr', 'swap', 'com', 'neg'):
+		a = R[d]
+		if a is None or (mn in ('rol', 'ror') and s.c is None):
+			v = None
+			s.c = None
+		elif mn == 'lsl':
+			v, s.c = (a << 1) & 0xff, a >> 7
+		elif mn == 'rol':
+			v, s.c = ((a << 1) | s.c) & 0xff, a >> 7
+		elif mn == 'lsr':
+			v, s.c = a >> 1, a & 1
+		elif mn == 'ror':
+			v, s.c = (a >> 1) | (s.c << 7), a & 1
+		elif mn == 'asr':
+			v, s.c = (a >> 1) | (a & 0x80), a & 1
+		elif mn == 'swap':
+			v = ((a << 4) | (a >> 4)) & 0xff
+		elif mn == 'com':
+			v, s.c = (~a) & 0xff, 1
+		else:
+			v, s.c = (-a) & 0xff, int(a != 0)
+		s.set(d, v)
+		if mn != 'swap':
+			s.z = None if v is None else int(v == 0)
+	elif mn == 'push':
+		s.stack = s.stack+(R[d],)
+	elif mn == 'pop':
+		if s.stack:
+			s.set(d, s.stack[-1])
+			s.stack = s.stack[:-1]
+		else:
+			s.set(d, None)
+	elif mn == 'std' or (mn == 'st' and ops[0].startswith('Y')):
+		m = re.match(r'Y\+?(\d*)$', ops[0])
+		if m:
+			s.y[int(m.group(1) or 0)] = R[reg(ops[1])]
+		else:
+			s.y = {}
+	elif mn == 'ldd' or (mn == 'ld' and ops[1].startswith('Y')):
+		m = re.match(r'Y\+?(\d*)$', ops[1])
+		s.set(d, s.y.get(int(m.group(1) or 0)) if m else None)
+		if not m:
+			s.set(28, None)
+			s.set(29, None)
+	elif mn in ('ld', 'lpm', 'elpm'):
+		s.set(d, None)
+		if len(ops) > 1 and ('+' in ops[1] or '-' in ops[1]):
+			base = {'X': 26, 'Y': 28, 'Z': 30}[ops[1].strip('+-')]
+			s.set(base, None)
+			s.set(base+1, None)
+	elif mn == 'st':
+		if '+' in ops[0] or '-' in ops[0]:
+			base = {'X': 26, 'Y': 28, 'Z': 30}[ops[0].strip('+-')]
+			s.set(base, None)
+			s.set(base+1, None)
+	elif mn in ('in', 'lds'):
+		s.set(d, None)
+	elif mn in ('mul', 'muls', 'mulsu', 'fmul', 'fmuls', 'fmulsu'):
+		s.set(0, None)
+		s.set(1, None)
+		s.z = s.c = None
+	elif mn in ('out', 'sts', 'nop', 'cli', 'sei', 'sleep', 'wdr', 'cbi', 'sbi',
+		'bst', 'sec', 'clc', 'sez', 'clz', 'sen', 'cln', 'set', 'clt', 'break'):
+		if mn in ('sec', 'clc'):
+			s.c = int(mn == 'sec')
+		elif mn in ('sez', 'clz'):
+			s.z = int(mn == 'sez')
+		elif mn == 'out' and ops[0] in ('0x3f', '0x3d', '0x3e'):
+			s.z = s.c = None
+	else:
+		# not modelled, forget the destination and the flags
+		s.set(d, None)
+		s.z = s.c = None
+	return [(nxt, s, cyc)]
+
+
+class Walk:
+	# fewest and most cycles from a start to the end of a path
+	def __init__(self, p, ends, cuts, cutCalls, bounds):
+		self.p = p
+		self.bounds = dict(LOOP_BOUNDS, **bounds)
+		self.ends = set(p.syms[e] for e in ends if e in p.syms)
+		self.cuts = set(p.syms[c] for c in cuts if c in p.syms)
+		self.cutCalls = set(p.syms[c] for c in cutCalls if c in p.syms)
+		self.counted = set()
+
+	def run(self, start, seed):
+		while True:
+			self.memo = {}
+			self.onPath = {}
+			self.path = []
+			self.visits = {}
+			s = State()
+			for r, v in seed.items():
+				s.r[r] = v
+			try:
+				return self.cost(self.p.syms[start], s, True)
+			except Retry:
+				pass
+
+	def cost(self, adr, s, first=False):
+		if adr is None:
+			return (0, 0)
+		if not first:
+			if adr in self.ends and not s.rets:
+				return (0, 0)
+			if adr in self.cuts:
+				return None
+		depth = len(s.rets)
+		if adr in self.counted:
+			# iterations of this loop in the current call
+			f = self.p.func(adr)
+			counts = dict(s.counts)
+			n = counts.get((adr, depth), 0)+1
+			if n > self.bounds[f]:
+				return None
+			counts[(adr, depth)] = n
+			s = s.copy()
+			s.counts = tuple(sorted(counts.items()))
+		key = (adr, s.key())
+		if key in self.memo:
+			return self.memo[key]
+		n = self.visits.get(adr, 0)
+		if key in self.onPath or n >= MAX_ITER:
+			# nothing known changes around this loop, or it never ends,
+			# count the loop at its first address in the outermost call
+			if key in self.onPath:
+				i = self.onPath[key]
+			else:
+				i = max(j for j, (a, d) in enumerate(self.path) if a == adr)
+			top = min(d for a, d in self.path[i:])
+			head = [a for a, d in self.path[i:] if d == top][0]
+			f = self.p.func(head)
+			if f not in self.bounds:
+				raise Unbounded('loop at 0x%x in %s, add %s to LOOP_BOUNDS' % (head, f, f))
+			self.counted.add(head)
+			raise Retry()
+		self.onPath[key] = len(self.path)
+		self.path.append((adr, depth))
+		self.visits[adr] = n+1
+		best = None
+		mn, ops, size, target = self.p.ins[adr]
+		if mn in ('call', 'rcall') and target in self.cutCalls:
+			succ = []
+		else:
+			succ = step(self.p, adr, s)
+		for nxt, ns, cyc in succ:
+			c = self.cost(nxt, ns)
+			if c is None:
+				continue
+			c = (c[0]+cyc, c[1]+cyc)
+			best = c if best is None else (min(best[0], c[0]), max(best[1], c[1]))
+		del self.onPath[key]
+		self.path.pop()
+		self.visits[adr] = n
+		self.memo[key] = best
+		return best
+
+
+def main():
+	if len(sys.argv) != 2:
+		sys.exit('usage: avr-objdump -d sdisk2.elf | python3 cycles.py F_CPU')
+	fcpu = int(sys.argv[1].rstrip('UL'))
+	cell = fcpu//250000
+	p = Prog(sys.stdin.read().splitlines())
+	p.entries = set(n for n in p.syms if not n.startswith('.'))
+	fail = [False]
+
+	def walk(start, ends, cuts=(), cutCalls=(), seed={}, bounds={}):
+		if start not in p.syms:
+			print('%-40s missing' % start)
+			fail[0] = True
+			return None
+		try:
+			return Walk(p, ends, cuts, cutCalls, bounds).run(start, seed)
+		except Unbounded as e:
+			print('%-40s %s' % (start, e))
+			fail[0] = True
+			return None
+
+	def report(name, c, lo=None, hi=None, extra=0):
+		if c is None:
+			return
+		c = (c[0]+extra, c[1]+extra)
+		ok = (lo is None or c[0] >= lo) and (hi is None or c[1] <= hi)
+		limit = ''
+		if lo is not None or hi is not None:
+			limit = '%s%s' % ('' if lo is None else '>= %d ' % lo, '' if hi is None else '<= %d' % hi)
+		print('%-40s %6d - %6d cycles %7.1f cells  %-16s %s' % (name, c[0], c[1],
+			c[1]/float(cell), limit, '' if lo is None and hi is None else ('ok' if ok else 'FAIL')))
+		if not ok:
+			fail[0] = True
+
+	print('F_CPU %d, bit cell %d cycles' % (fcpu, cell))
+
+	# one bit of READ PULSE out of the read ring
+	v16 = walk('__vector_16', ())
+	report('__vector_16, a bit', v16, hi=cell, extra=ENTRY)
+	if '__vector_10' in p.syms:
+		# make WRITE_ICP=1, a transition a cell after the last has to be
+		# taken before the next one overwrites ICR1; after a gap that fills
+		# the latch, the next one a cell later still has to be reached
+		# before the one after it
+		report('__vector_10, a cell after the last', walk('__vector_10', (),
+			bounds={'__vector_10': 1}), hi=cell, extra=ENTRY)
+		report('__vector_10, a full latch', walk('__vector_10', ()),
+			hi=2*cell-ENTRY, extra=ENTRY)
+	else:
+		# the write capture samples once a cell
+		report('__vector_1, a bit', walk('WLP1', ('WLP1',), ('WRITE_END', 'NOT_START', 'WLP2')),
+			lo=cell-1, hi=cell+1)
+		report('__vector_1, last bit to next nibble', walk('WLP5', ('WLP6',), ('WRITE_END',),
+			seed={18: 1}), hi=cell)
+		report('__vector_1, start bit to first sample', walk('WLP6', ('WLP5',), ('WRITE_END', 'WLP6')),
+			lo=cell, hi=2*cell)
+		report('writeBack from __vector_1', walk('writeBack', ()))
+	# __vector_3 is ISR_NOBLOCK, a bit waits for its sei and the instruction
+	# after it and still has to end within the cell
+	v3 = walk('__vector_3', ())
+	if v3 and v16:
+		adr = p.syms['__vector_3']
+		if p.ins[adr][0] != 'sei':
+			print('%-40s does not start with sei' % '__vector_3')
+			fail[0] = True
+		else:
+			held = 1+CYCLES.get(p.ins[adr+p.ins[adr][2]][0], 1)
+			report('__vector_3, until __vector_16', (held, held),
+				hi=cell-v16[1]-ENTRY, extra=ENTRY)
+		# PCIF0 holds a change while the one before is taken, a state has
+		# to last until it is read; __vector_16 leaves the handler what is
+		# left of each cell, and a state of a switch command, the shortest
+		# the Apple II holds, lasts SWITCH_HOLD
+		hold = fcpu//1000000*SWITCH_HOLD
+		report('__vector_3, a phase state', v3,
+			hi=hold*(cell-v16[1]-ENTRY)//cell, extra=ENTRY)
+	# the next sector is started while the ring still holds the one
+	# before, 416 bytes
+	nic = None
+	a = walk('sectorAddr', (), (), ('fatEntry',))
+	b = walk('cmd18Fast', ())
+	if a and b:
+		nic = (a[0]+b[0], a[1]+b[1])
+	report('start a NIC sector', nic, hi=416*8*cell)
+	report('start a DSK sector', walk('readDsk', (), (), ('fatEntry',)), hi=416*8*cell)
+	# after the last bit of a WOZ track the stream starts again at its
+	# beginning, the ring covers that as well
+	report('wrap a WOZ track', walk('wozSeek', (), (), ('fatEntry',)), hi=416*8*cell)
+	sys.exit(1 if fail[0] else 0)
+
+
+if __name__ == '__main__':
+	sys.setrecursionlimit(1000000)
+	threading.stack_size(512*1024*1024)
+	t = threading.Thread(target=main)
+	t.start()
+	t.join()
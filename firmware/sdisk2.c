@@ -8,10 +8,15 @@
 ------------------------------------------------------*/
 
 /*
-if the crystal on your SDISK II is 25 MHz, 
-I recommend you to replace it with 27 MHz,
-or ask Nishida Radio.
-see also sub.S
+if the crystal on your SDISK II is not 27 MHz, set F_CPU in the
+Makefile to it, see sub.S.
+*/
+
+/*
+an image in a subdirectory is mounted through the catalog tools/catalog
+writes on the card, see catMount(). a program on the Apple II goes to
+another image of the catalog with a switch command through the stepper
+phases, see SWITCH_KEY.
 */
 
 /*
@@ -46,6 +51,15 @@ connection:
 	
 	Note that the enable input of the 3state buffer 74HC125,
 	should be connected with DRIVE ENABLE.
+
+	a PO, HDV or 2MG image on a card with no disk image is served as a
+	SmartPort block device (IIc, IIgs): PHASE-0 is REQ, WRITE PROTECT is ACK,
+	PHASE-1 and PHASE-3 high enable the bus. DRIVE ENABLE stays off then,
+	the 74HC125 must also be enabled while PHASE-1 and PHASE-3 are high.
+
+	make WRITE_ICP=1 decodes WRITE with the Timer1 input capture instead of
+	__vector_1, through the analog comparator: C2 is ADC2 against the
+	bandgap, no wiring changes.
 */
 
 /*
@@ -70,17 +84,54 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include "sdisk2.h"
 
 #define WAIT 1
-#define BUF_NUM 5
-#define FAT_DSK_ELEMS 18
-#define FAT_NIC_ELEMS 35
+#define EXT_NUM 12
+#define CACHE_NUM 2
+#ifdef STATS
+#define MOUNT_MAGIC 0xd9				// the entry holds statsDir too
+#else
+#define MOUNT_MAGIC 0xd8
+#endif
+// the buffers are full, the next one is readData or readRing
+#define BUF_FULL (BUF_NUM-dskMode)
+#ifdef WRITE_ICP
+// timer ticks of a bit cell; fillRing() stops at the next nibble while a
+// capture runs, and no write starts while the buffers are full, so a
+// capture reaches readData or readRing no sooner than 256 nibbles on
+#define ICP_CELL (F_CPU/250000)
+#endif
 #define nop() __asm__ __volatile__ ("nop")
 
+// the buffers are written back FLUSH_IDLE ms after the last sector was
+// captured, 0 leaves them until the drive is turned off; main() counts
+// the Timer2 overflows, 256*1024 cycles each, up to 254
+#ifndef FLUSH_IDLE
+#define FLUSH_IDLE 500
+#endif
+#define FLUSH_TICKS ((FLUSH_IDLE*(F_CPU/1000)+262143)/262144)
+#if FLUSH_TICKS > 254
+#error "FLUSH_IDLE is too long for F_CPU"
+#endif
+
 // C prototypes
 
-// cancel read
+// stop reading and drop the bytes filled ahead
 void cancelRead(void);
+// drop the bytes filled ahead after a write, write the buffers back when full
+void restartRead(void);
+// keep __vector_1 and __vector_16 out while the SD card is busy
+void diskIntOff(void);
+// let them in again
+void diskIntOn(void);
+// the sector passing under the head
+unsigned char headSector(void);
+// fill the read ring ahead of __vector_16
+void fillRing(void);
+// write the buffers back while the Apple II leaves the drive alone
+void idleFlush(void);
 // write a byte data to the SD card
 void writeByteSlow(unsigned char c);
 void writeByteFast(unsigned char c);
@@ -97,56 +148,210 @@ void cmdFast(unsigned char cmd, unsigned long adr);
 unsigned char getRespSlow(void);
 // get command response fast from the SD card
 unsigned char getRespFast(void);
+// issue a block read/write command with a sector number
+void cmdSector(unsigned char cmd, unsigned long sec);
+// wait for the data token of a block read
+void waitToken(void);
 // issue command 17 and get ready for reading
-void cmd17Fast(unsigned long adr);
+void cmd17Fast(unsigned long sec);
+// get ready for reading, continuing the multiple block read if possible
+void cmd18Fast(unsigned long sec);
+// stop the multiple block read
+void stopRead(void);
+// issue ACMD23 and command 25 to write num sectors
+void cmd25Fast(unsigned long sec, unsigned short num);
+// finish a data block and wait until it is written
+void writeBlockEnd(void);
+// stop a multiple block write
+void stopTranFast(void);
+// read a sector into the metadata cache
+unsigned char *readCache(unsigned long sec);
+// write a sector in the metadata cache back
+void writeCache(unsigned long sec);
+// invalidate the metadata cache
+void cacheClear(unsigned char off);
 // find a file extension
 int findExt(char *str, unsigned char *protect, unsigned char *name);
-// prepare the FAT table on memory
-void prepareFat(int i, unsigned short *fat, unsigned short len,
-	unsigned char fatNum, unsigned char fatElemNum);
+// a root directory entry findExt() looks at
+unsigned char fileEntry(unsigned char *p);
+// the root directory entry coldMount() starts from
+unsigned short rootPick(void);
+// pick an image from the catalog file
+unsigned char catMount(unsigned short idx, unsigned char *twoMg);
+// the first cluster of the catalog in catDir, 0 if it is not one of this volume
+unsigned short catStart(void);
+// follow a cluster chain n links on
+unsigned short fatEntry(unsigned short ft, unsigned short n);
+// build the cluster extent map of a file
+unsigned char buildExt(unsigned short dir, unsigned short *extLc, unsigned short *extFt,
+	unsigned short len);
+// get the SD card sector holding a sector of a mapped file
+unsigned long sectorAddr(unsigned short *extLc, unsigned short *extFt,
+	unsigned char extNum, unsigned short long_sector);
 // memory copy	
 void memcp(unsigned char *dst, unsigned char *src, const unsigned short len);
-// duplicate FAT for FAT16
-void duplicateFat(void);
 // write to the SD cart one by one
-void writeSD(unsigned long adr, unsigned char *data, unsigned short len);
-// create a NIC image file
-int createNic(unsigned char *name);
-// translate a NIC image into a DSK image
-void nic2Dsk(void);
-// translate a DSK image into a NIC image
-void dsk2Nic(void);
+void writeSD(unsigned long sec, unsigned short ofs, unsigned char *data, unsigned short len);
+// decode captured nibbles in place
+unsigned char decode62(unsigned char *p);
+// the 6-bit value behind a 6-and-2 nibble
+unsigned char x62(unsigned char *src, unsigned short i);
+// encode 256 bytes into 342 6-and-2 nibbles and a checksum, or send them
+void encode62(unsigned char *dst, unsigned char *src);
+// a byte of the nibble header
+unsigned char headByte(unsigned char i, unsigned char trk, unsigned char sc);
+// read a sector of the DSK image into readData
+void readDsk(unsigned char trk, unsigned char sc);
+// read a few bytes of the image, within one sector
+void readImg(unsigned long ofs, unsigned char *dst, unsigned char n);
+// look a quarter track up in the WOZ image
+void wozTrack(unsigned char qt);
+// move the WOZ stream to a byte of the image
+void wozSeek(unsigned long ofs);
+// the next byte of the WOZ stream
+unsigned char readWoz(void);
+// the next 8 bits of the WOZ track
+unsigned char wozFill(void);
 // initialization called from check_eject
 void init(void);
+// mount the volume and map the newest image, 0 if there is none
+unsigned char coldMount(void);
+// map the image picked, 0 if it can't be served
+unsigned char mapImage(unsigned char twoMg);
+// the drive state for the image just mapped
+void startDrive(void);
+// mount from the EEPROM entry, 0 if the card doesn't match it
+unsigned char warmMount(void);
+// keep the mount in the EEPROM for the next insert
+void saveMount(void);
 // called when the SD card is inserted or removed
 void check_eject(void);
+// serve another image of the catalog, asked for by the Apple II
+void switchImage(void);
 // write data back to a NIC image 
 void writeBack(void);
 void writeBackSub(void);
-void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track);
+void writeBackNic(void);
+void writeBackDsk(void);
+void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track,
+	unsigned char token);
 // buffer clear
 void buffClear(void);
+// read or write a block of the SmartPort image at spBlock
+void spReadBlock(unsigned short bn);
+void spWriteBlock(unsigned short bn);
+// decode the packet in writeData into dst, its length or 0xffff if broken
+unsigned short spDecode(unsigned char *dst, unsigned short max);
+// build a response packet of n bytes of spBlock in writeData, returns its length
+unsigned short spEncode(unsigned char type, unsigned char stat, unsigned short n);
+// take a captured packet, 0 if it is not for us
+unsigned char spTake(unsigned char data);
+// run the command taken, returns the length of the response
+unsigned short spExec(unsigned char data);
+// send a response through the read ring
+void spSend(unsigned short len);
+// the bus is enabled and the card is in
+unsigned char spAlive(void);
+// serve the SmartPort bus, called from main()
+void spBus(void);
+#ifdef STATS
+// write the counters to the STA file
+void saveStats(void);
+#endif
+#ifdef WRITE_ICP
+// end the capture of the Timer1 input capture
+void icpEnd(void);
+// hand a finished capture to writeBack()
+void icpTake(void);
+#endif
 
 // assembler functions
 void wait5(unsigned short time);
 
-// SD card information
+// SD card information, all addresses are in sectors
+unsigned char sdhc;						// block addressed card
 unsigned long bpbAddr, rootAddr;
 unsigned long fatAddr;					// the beginning of FAT
 unsigned short fileFatTop;
 unsigned char sectorsPerCluster, sectorsPerCluster2;	// sectors per cluster
 unsigned short sectorsPerFat;	
 unsigned long userAddr;					// the beginning of user data
-// unsigned short fatDsk[FAT_DSK_ELEMS];// use writeData instead
-unsigned short fatNic[FAT_NIC_ELEMS];
-unsigned char prevFatNumDsk, prevFatNumNic;
-unsigned short nicDir, dskDir;
+unsigned long streamAdr;				// the next sector of the multiple block read
+unsigned short nicDir, dskDir, wozDir, blkDir;
+unsigned long dirAddr;					// the sector the image's entry is counted from,
+										// rootAddr or the catalog's entry sector
+unsigned short catDir;					// root directory entry of the catalog, 512 if none
+unsigned short catCluster;				// its first cluster, looked up by catMount() once
+										// a mount while 0xffff, 0 if there is none
+// cluster extents: extLc[e] is the first cluster index in the file of extent e,
+// extFt[e] its FAT cluster number, extLc[extNum] the number of mapped clusters,
+// extLc[EXT_NUM+1] and extFt[EXT_NUM] where the last FAT walk past a full map stopped
+unsigned short imgExtLc[EXT_NUM+2], imgExtFt[EXT_NUM+1];
+unsigned char imgExtNum;
+// the last mount, keyed by the volume serial number and the directory
+// entry of the image, a card that matches is mounted without the scans
+struct mountEntry {
+	unsigned char magic;				// MOUNT_MAGIC when the rest is valid
+	unsigned char serial[4];			// volume serial number
+	unsigned char stamp[4];				// time and date of the image
+	unsigned short cluster;				// its first cluster
+	unsigned long size;					// its size in bytes
+	unsigned long bpbAddr, fatAddr, rootAddr, userAddr;
+	unsigned char sectorsPerCluster2;
+	unsigned long dirAddr;
+	unsigned short dir, catDir;
+	unsigned char dskMode, woz;
+	unsigned char smartPort, spLock;
+	unsigned short spBlocks, spOfs;
+	unsigned char extNum;
+	unsigned short extLc[EXT_NUM+1], extFt[EXT_NUM];
+	unsigned char track;				// ph_track when the card was removed
+#ifdef STATS
+	unsigned short statsDir;
+#endif
+};
+EEMEM struct mountEntry eeMount;
+// the catalog record mounted, kept apart from the mount entry
+EEMEM unsigned short eeCatIndex;
+#define eeRead(dst, field) \
+	eeprom_read_block((void *)(dst), (const void *)&eeMount.field, sizeof(eeMount.field))
+#define eeWrite(src, field) \
+	eeprom_update_block((const void *)(src), (void *)&eeMount.field, sizeof(eeMount.field))
+
+// metadata cache, whole sectors kept in writeData while no write is buffered
+unsigned long cacheAdr[CACHE_NUM];
+unsigned char cacheOld;
+
+#ifdef STATS
+// counters for qualifying cards, make STATS=1: they are written to the
+// first sector of the newest file with the STA extension, which must be
+// there at a cold mount, each time the drive is turned off with no sector
+// buffered; little endian, they wrap around
+struct stats {
+	unsigned long misses;				// __vector_16 cells with no data while the drive
+										// is on, first as sub.S counts it
+	unsigned short tokenWait[8];		// block reads by 0xff bytes before the data token:
+										// 0, 1, 2-3, 4-7 ... 64 and more
+	unsigned short retries;				// commands sent again by cmdFast
+	unsigned long busy;					// bytes read by waitFinish
+	unsigned short fatWalks;			// FAT entries read past the extent map
+	unsigned short cancels;				// cancelRead with bytes filled ahead
+	unsigned short flushes;				// writeBackSub with sectors to write
+	unsigned short saves;				// times the counters were written
+} stats;
+unsigned short statsDir;				// directory entry of the file, 512 if there is none
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
 
 // DISK II status
-unsigned char ph_track;					// 0 - 139
-unsigned char sector;					// 0 - 15
-unsigned short bitbyte;					// 0 - (8*512-1)
-unsigned char prepare;
+volatile unsigned char ph_track;		// 0 - 139, moved by PCINT0
+volatile unsigned short switchCmd;		// 0x100 and the argument of a switch command
+										// from PCINT0, 0 if there is none
+unsigned char sector;					// 0 - 15, the sector being filled
+unsigned short bitbyte;					// bits sent, wraps around
+unsigned char prepare;					// __vector_16 is stopped
 unsigned char readPulse;
 unsigned char inited;
 unsigned char magState;
@@ -154,15 +359,85 @@ unsigned char protect;
 unsigned char formatting;
 const unsigned char volume = 0xfe;
 
-// write data buffer
-unsigned char writeData[BUF_NUM][350];
+// read pipeline: __vector_16 shifts the bits out of readRing, main() fills
+// it with the sectors as they pass under the head, RING bytes each, as far
+// ahead as there is room; __vector_16 stops when it catches up (bitLimit)
+// a DSK sector is read into writeBuf(BUF_NUM-1), which is not a write buffer then
+#define readRing writeBuf(BUF_NUM)
+unsigned char dskMode;					// serving a DSK image
+unsigned char *readPtr, *readData;		// the next byte, the DSK sector
+unsigned char readByte;
+unsigned short bitLimit;				// bits filled in, wraps around
+unsigned char *fillPtr;					// the next byte to fill
+unsigned short fillPos;					// bytes of sector filled, 0 - (RING-1)
+unsigned char fillTrk, fillX;			// track of sector, last 6-and-2 value
+unsigned char *fillSrc;					// the data of the sector, 0 if it is read
+										// from a NIC image
+unsigned char restart, nextSector;		// set by writeBack()
+volatile unsigned char idleTicks;		// Timer2 overflows since writeBack() took a sector
+// a WOZ image is streamed a bit at a time from the SD card, its tracks
+// are looked up by quarter track and wrap at their bit count
+unsigned char woz;						// WOZ version, 0 if not a WOZ image
+unsigned long trkStart;					// image offset of the track's bits
+unsigned short trkBits;					// bits of the track, 0 if there is none
+unsigned short wozBit;					// the next bit of the track to fill
+unsigned short wozBlk, wozOff;			// image sector being read, bytes read of it
+unsigned char wozByte;					// bits left of the last byte read
+// a block image is served on the SmartPort bus instead, packets are captured
+// by __vector_1 from writeStart on and sent by __vector_16 out of readRing
+#define spBlock writeBuf(3)
+unsigned char smartPort;				// serving a block image
+unsigned char spLock;					// a 2MG image locked in its header
+unsigned short spBlocks;				// blocks of the image
+unsigned short spOfs;					// image offset of block 0, 64 for a 2MG image
+unsigned char spId;						// unit id given by INIT, 0 after a bus reset
+volatile unsigned char spRecv;			// a packet has been captured
+unsigned short writeMax;				// nibbles __vector_1 captures at most
+unsigned char writeStart;				// the nibble it starts capturing at
+#ifdef WRITE_ICP
+// the capture by flux transitions, main() goes on meanwhile
+unsigned char *icpBuf, *icpPtr;			// where the capture started, the next nibble
+unsigned short icpLeft;					// nibbles left to store
+unsigned short icpLast;					// ICR1 at the last transition
+unsigned char icpLatch, icpStore;		// bits shifted in, storing from writeStart on
+volatile unsigned char writeDone;		// a capture waits for main()
+#endif
+
+// write data buffer, decoded sectors of 256 bytes: a data field is captured
+// into the 350 bytes from the next free sector on, decoded in place
+// and moved down to the start; the read ring follows the last one
+#define writeBuf(n) (writeData+((unsigned short)(n)<<8))
+unsigned char writeData[BUF_NUM*256+RING];
 unsigned char sectors[BUF_NUM], tracks[BUF_NUM];
 unsigned char buffNum;
 unsigned char *writePtr;
 
+// sync bytes of the nibble header
+PROGMEM prog_uchar syncTable[5] = {0xfc,0xff,0x3f,0xcf,0xf3};
+
+// sync bytes of a SmartPort packet
+PROGMEM prog_uchar spSync[6] = {0xff,0x3f,0xcf,0xf3,0xfc,0xff};
+
+// the SmartPort device information block from the ID string on
+PROGMEM prog_uchar spDib[21] = {
+	8,'S','D','I','S','K',' ','I','I',' ',' ',' ',' ',' ',' ',' ',' ',
+	0x02,0x00,0x13,0x00		// hard disk, firmware version
+};
+
 // a table for head stepper moter movement 
 PROGMEM prog_uchar stepper_table[4] = {0x0f,0xed,0x03,0x21};
 
+// switch command: RWTS never turns on two opposite phases, the Apple II
+// sends a bit with the drive on as PHASE-0 and PHASE-2 on for a 0 or
+// PHASE-1 and PHASE-3 on for a 1, going from one to the next through
+// three or four phases on; a single phase on starts over. SWITCH_KEY
+// and then the argument, MSB first: SWITCH_NEXT, SWITCH_PREV or the
+// catalog record number. each state is held 1 ms at least, as RWTS
+// holds a phase, PCINT0 is slowed down by __vector_16 (see cycles.py)
+#define SWITCH_KEY 0xa5
+#define SWITCH_NEXT 0xff
+#define SWITCH_PREV 0xfe
+
 // encode / decode table for a nib image
 PROGMEM prog_uchar encTable[] = {
 	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
@@ -196,6 +471,9 @@ PROGMEM prog_uchar decTable[] = {
 // a table for translating logical sectors into physical sectors
 PROGMEM prog_uchar physicalSector[] = {
 		0,13,11,9,7,5,3,1,14,12,10,8,6,4,2,15};
+// and physical sectors into logical sectors
+PROGMEM prog_uchar logicalSector[] = {
+		0,7,14,6,13,5,12,4,11,3,10,2,9,1,8,15};
 
 // for bit flip
 PROGMEM prog_uchar FlipBit[] = { 0,  2,  1,  3  };
@@ -209,26 +487,182 @@ void buffClear(void)
 	unsigned char i;
 	unsigned short j;
 	
-	for (i=0; i<BUF_NUM; i++)
-		for (j=0; j<350; j++)
-			writeData[i][j]=0;
+	for (j=0; j<sizeof(writeData); j++)
+		writeData[j]=0;
 	for (i=0; i<BUF_NUM; i++)
 		sectors[i]=tracks[i]=0xff;
 }
 
-// cancel read from the SD card
+// stop __vector_16 and drop the bytes filled ahead, the sector being
+// filled is read again from its beginning, a WOZ track from the head
 void cancelRead(void)
 {
 	unsigned short i;
-	if (bitbyte<(402*8)) {
-		PORTD = 0b00010000;
-		for (i=bitbyte; i<(514*8); i++) {
+
+	STAT(if (bitLimit != bitbyte) stats.cancels++);
+	prepare = 1;
+	// finish the block of a NIC sector
+	if (!fillSrc && fillPos) {
+		for (i=fillPos; i<514; i++) {
 			if (bit_is_set(PIND,3)) return;
-			PORTD = 0b00110000;
-			PORTD = 0b00010000;
+			readByteFast();
+		}
+	}
+	// a WOZ track goes on from the byte under the head
+	if (woz) {
+		for (; wozOff<514; wozOff++) {
+			if (bit_is_set(PIND,3)) return;
+			readByteFast();
 		}
-		bitbyte = 402*8;
+		if (trkBits) wozBit = ((((unsigned long)wozBit+trkBits-
+			((unsigned short)(bitLimit-bitbyte)%trkBits))%trkBits)&~7);
 	}
+	fillPos = 0;
+	bitbyte = bitLimit = 0;
+	readPtr = fillPtr = readRing;
+}
+
+// after a write the head has moved on while __vector_16 was held,
+// start again at the sector writeBack() chose
+void restartRead(void)
+{
+	diskIntOff();
+	cancelRead();
+	if (buffNum == BUF_FULL) writeBackSub();
+	sector = nextSector;
+	restart = 0;
+	diskIntOn();
+}
+
+// the disk interrupts are masked rather than all of them,
+// PCINT0 keeps following the stepper; a capture by Timer1 goes on,
+// but no write starts until diskIntOn()
+void diskIntOff(void)
+{
+	TIMSK0 &= ~(1<<TOIE0);
+	EIMSK &= ~(1<<INT0);
+}
+
+void diskIntOn(void)
+{
+	if (!inited) return;
+#ifdef WRITE_ICP
+	// __vector_16 rests while a capture runs, icpTake() lets
+	// a write in again once main() has the last one
+	cli();
+	if (!(TIMSK1 & (1<<ICIE1))) TIMSK0 |= (1<<TOIE0);
+	if (!writeDone && (buffNum != BUF_FULL)) EIMSK |= (1<<INT0);
+	sei();
+#else
+	TIMSK0 |= (1<<TOIE0);
+	EIMSK |= (1<<INT0);
+#endif
+}
+
+// the sector passing under the head, the one being filled
+// or the one before when __vector_16 is still in it
+unsigned char headSector(void)
+{
+	if (((unsigned short)(bitLimit-bitbyte)>>3) > fillPos) return ((sector-1)&0xf);
+	return sector;
+}
+
+// fill readRing as far ahead of __vector_16 as there is room, a sector in
+// the write buffer is encoded from there and stays buffered; __vector_16
+// is started again once the ring is full
+void fillRing(void)
+{
+	unsigned char c, i, x;
+	unsigned short ahead, k;
+
+	for (;;) {
+		if (bit_is_set(PIND,3)) return;
+		cli();
+		ahead = bitLimit-bitbyte;
+		if (prepare && !restart && (ahead == RING*8)) prepare = 0;
+		sei();
+		if (restart || (ahead >= RING*8)) return;
+#ifdef WRITE_ICP
+		if (writeDone || (TIMSK1 & (1<<ICIE1))) return;
+#endif
+		if (woz) {
+			// the head has stepped, main() looks the new track up
+			if (ph_track != fillTrk) return;
+			*fillPtr++ = wozFill();
+			if (fillPtr == readRing+RING) fillPtr = readRing;
+			cli();
+			bitLimit += 8;
+			sei();
+			continue;
+		}
+		// the head has stepped, main() starts on the new track
+		if (fillPos && ((ph_track>>2) != fillTrk)) return;
+		if (!fillPos) {
+			fillTrk = (ph_track>>2);
+			// the last one buffered if the sector was written twice
+			for (k=BUF_NUM, i=0; i<BUF_NUM; i++)
+				if ((sectors[i]==sector)&&(tracks[i]==fillTrk)) k = i;
+			if (k!=BUF_NUM) fillSrc = writeBuf(k);
+			else if (dskMode) {
+				readDsk(fillTrk, sector);
+				fillSrc = readData;
+			} else {
+				cmd18Fast(sectorAddr(imgExtLc, imgExtFt, imgExtNum,
+					(unsigned short)fillTrk*16+sector));
+				fillSrc = 0;
+			}
+			fillX = 0;
+		}
+		if (!fillSrc) c = readByteFast();
+		else if (fillPos < 0x38) c = headByte(fillPos, fillTrk, sector);
+		else if ((k = fillPos-0x38) < 343) {
+			x = x62(fillSrc, k);
+			c = pgm_read_byte_near(encTable+(x^fillX));
+			fillX = x;
+		} else if (k == 343) c = 0xde;
+		else if (k == 344) c = 0xaa;
+		else if (k == 345) c = 0xeb;
+		else c = 0xff;
+		*fillPtr++ = c;
+		if (fillPtr == readRing+RING) fillPtr = readRing;
+		cli();
+		bitLimit += 8;
+		fillPos++;
+		sei();
+		if (fillPos == RING) {
+			// the rest of a NIC sector is not sent
+			if (!fillSrc) for (k=RING; k<514; k++) readByteFast();
+			cli();
+			fillPos = 0;
+			sector = ((sector+1)&0xf);
+			sei();
+		}
+	}
+}
+
+// the buffers go back to the card while the drive is off or once
+// FLUSH_IDLE has passed with no write, rather than when a later write
+// finds them full; Timer2 is polled, no interrupt holds __vector_16 up
+void idleFlush(void)
+{
+	unsigned char sc;
+
+	if (TIFR2 & (1<<TOV2)) {
+		TIFR2 = (1<<TOV2);
+		if (idleTicks != 0xff) idleTicks++;
+	}
+	if (!inited || smartPort || (sectors[0]==0xff)) return;
+	if (bit_is_clear(PINC, 0) && (!FLUSH_IDLE || (idleTicks < FLUSH_TICKS))) return;
+#ifdef WRITE_ICP
+	if (writeDone || (TIMSK1 & (1<<ICIE1))) return;
+#endif
+	// the head goes on meanwhile, as after a step
+	diskIntOff();
+	sc = headSector();
+	cancelRead();
+	writeBackSub();
+	sector = ((sc+1)&0xf);
+	diskIntOn();
 }
 
 // write a byte data to the SD card
@@ -302,6 +736,7 @@ void waitFinish(void)
 	do {
 		ch = readByteFast();
 		if (bit_is_set(PIND,3)) return;
+		STAT(stats.busy++);
 	} while (ch != 0xff);
 }
 
@@ -314,7 +749,7 @@ void cmd_(unsigned char cmd, unsigned long adr)
 	writeByteSlow((adr>>16)&0xff);
 	writeByteSlow((adr>>8)&0xff);
 	writeByteSlow(adr&0xff);
-	writeByteSlow(0x95);
+	writeByteSlow((cmd==8)?0x87:0x95);	// CRC is checked for CMD0 and CMD8
 	writeByteSlow(0xff);
 }
 
@@ -331,7 +766,9 @@ void cmdFast(unsigned char cmd, unsigned long adr)
 		writeByteFast(adr&0xff);
 		writeByteFast(0x95);
 		writeByteFast(0xff);
-	} while (((res=getRespFast())!=0) && (res!=0xff));
+		res = getRespFast();
+		STAT(if (res && (res!=0xff)) stats.retries++);
+	} while (res && (res!=0xff));
 }
 
 // get a command response slowly from the SD card
@@ -356,16 +793,141 @@ unsigned char getRespFast(void)
 	return ch;
 }
 
-// issue command 17 and get ready for reading
-void cmd17Fast(unsigned long adr)
+// issue a block read/write command with a sector number
+void cmdSector(unsigned char cmd, unsigned long sec)
+{
+	cmdFast(cmd, sdhc?sec:(sec<<9));
+}
+
+// wait for the data token of a block read
+void waitToken(void)
 {
 	unsigned char ch;
+#ifdef STATS
+	unsigned short n = 0;
+	unsigned char i;
+#endif
 
-	cmdFast(17, adr);
-	do {	
+	for (;;) {
 		ch = readByteFast();
 		if (bit_is_set(PIND,3)) return;
-	} while (ch != 0xfe);
+		if (ch == 0xfe) break;
+		STAT(n++);
+	}
+#ifdef STATS
+	for (i=0; (i<7)&&(n>>i); i++) ;
+	stats.tokenWait[i]++;
+#endif
+}
+
+// issue command 17 and get ready for reading
+void cmd17Fast(unsigned long sec)
+{
+	cmdSector(17, sec);
+	waitToken();
+}
+
+// get ready for reading, continuing the multiple block read if possible
+void cmd18Fast(unsigned long sec)
+{
+	if (sec!=streamAdr) {
+		stopRead();
+		cmdSector(18, sec);
+	}
+	streamAdr = sec+1;
+	waitToken();
+}
+
+// stop the multiple block read, called between blocks
+void stopRead(void)
+{
+	if (streamAdr==0xffffffff) return;
+	streamAdr = 0xffffffff;
+	writeByteFast(0xff);
+	writeByteFast(0x40+12);
+	writeByteFast(0);
+	writeByteFast(0);
+	writeByteFast(0);
+	writeByteFast(0);
+	writeByteFast(0x95);
+	writeByteFast(0xff);	// stuff byte
+	getRespFast();
+	waitFinish();
+}
+
+// issue ACMD23 and command 25 to write num sectors
+void cmd25Fast(unsigned long sec, unsigned short num)
+{
+	cmdFast(55, 0);
+	cmdFast(23, num);	// pre-erase
+	cmdSector(25, sec);
+}
+
+// finish a data block and wait until it is written
+void writeBlockEnd(void)
+{
+	writeByteFast(0xff);
+	writeByteFast(0xff);	// CRC
+	readByteFast();			// data response
+	waitFinish();
+}
+
+// stop a multiple block write
+void stopTranFast(void)
+{
+	writeByteFast(0xfd);
+	readByteFast();
+	waitFinish();
+}
+
+// invalidate the metadata cache
+// off: writeData is going to be used for something else
+void cacheClear(unsigned char off)
+{
+	unsigned char n;
+
+	for (n=0; n<CACHE_NUM; n++) cacheAdr[n] = 0xffffffff;
+	cacheOld = (off?CACHE_NUM:0);
+}
+
+// read a sector into the metadata cache and return it
+unsigned char *readCache(unsigned long sec)
+{
+	unsigned char n;
+	unsigned short i;
+	unsigned char *buf;
+
+	for (n=0; n<CACHE_NUM; n++)
+		if (cacheAdr[n]==sec) break;
+	if (n==CACHE_NUM) {
+		n = cacheOld;
+		buf = writeData+n*512;
+		cacheAdr[n] = sec;
+		cmd17Fast(sec);
+		for (i=0; i<512; i++) buf[i] = readByteFast();
+		readByteFast(); readByteFast(); // discard CRC bytes
+	}
+	cacheOld = ((n+1)%CACHE_NUM);
+	return writeData+n*512;
+}
+
+// write a sector in the metadata cache back
+void writeCache(unsigned long sec)
+{
+	unsigned short i;
+	unsigned char *buf = readCache(sec);
+
+	PORTD = 0b00000010;
+	PORTD = 0b00000000;	
+				
+	cmdSector(24, sec);		
+	writeByteFast(0xff);
+	writeByteFast(0xfe);
+	for (i=0; i<512; i++) writeByteFast(buf[i]);
+	writeBlockEnd();
+	
+	PORTD = 0b00000010;
+	PORTD = 0b00000000;	
 }
 
 // find a file extension
@@ -374,42 +936,17 @@ int findExt(char *str, unsigned char *protect, unsigned char *name)
 	short i;
 	unsigned max_file = 512;
 	unsigned short max_time = 0, max_date = 0;
+	unsigned char *p;
 
 	// find NIC extension
 	for (i=0; i!=512; i++) {
-		unsigned char ext[3], d;
-		unsigned char time[2], date[2];
-		
 		if (bit_is_set(PIND,3)) return 512;
-		// check first char
-		cmdFast(16, 1);
-		cmd17Fast(rootAddr+i*32);
-		d = readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if ((d==0x00)||(d==0x05)||(d==0x2e)||(d==0xe5)) continue;
-		if (!(((d>='A')&&(d<='Z'))||((d>='0')&&(d<='9')))) continue;
-		cmd17Fast(rootAddr+i*32+11);
-		d = readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if (d&0x1e) continue;
-		if (d==0xf) continue;
-		// check extension
-		cmdFast(16, 4);
-		cmd17Fast(rootAddr+i*32+8);
-		ext[0] = readByteFast(); ext[1] = readByteFast(); ext[2] = readByteFast();
-		if (protect) *protect = ((readByteFast()&1)<<3); else readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-		
-		
-		// check time stamp
-		cmdFast(16, 4);
-		cmd17Fast(rootAddr+i*32+22);
-		time[0] = readByteFast(); time[1] = readByteFast();
-		date[0] = readByteFast(); date[1] = readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if ((ext[0]==str[0])&&(ext[1]==str[1])&&(ext[2]==str[2])) {
-			unsigned short tm = *(unsigned short *)time;
-			unsigned short dt = *(unsigned short *)date;
+		p = readCache(rootAddr+(i>>4))+(i&0xf)*32;
+		if (!fileEntry(p)) continue;
+		// check extension and time stamp
+		if ((p[8]==str[0])&&(p[9]==str[1])&&(p[10]==str[2])) {
+			unsigned short tm = *(unsigned short *)(p+22);
+			unsigned short dt = *(unsigned short *)(p+24);
 
 			if ((dt>max_date)||((dt==max_date)&&(tm>=max_time))) {
 				max_time = tm;
@@ -418,41 +955,240 @@ int findExt(char *str, unsigned char *protect, unsigned char *name)
 			}
 		}
 	}
-	if ((max_file != 512) && (name != 0)) {
-		unsigned char j;
-		cmdFast(16, 8);
-		cmd17Fast(rootAddr+max_file*32);
-		for (j=0; j<8; j++) name[j] = readByteFast();
-		readByteFast(); readByteFast();
+	if (max_file != 512) {
+		p = readCache(rootAddr+(max_file>>4))+(max_file&0xf)*32;
+		if (protect) *protect = ((p[11]&1)<<3);
+		if (name) memcp(name, p, 8);
 	}
 	return max_file;
 	// if 512 then not found...
 }
 
-// prepare a FAT table on memory
-void prepareFat(int i, unsigned short *fat, unsigned short len,
-	unsigned char fatNum, unsigned char fatElemNum)
+// a file, not a free entry, a long name, a directory or hidden
+unsigned char fileEntry(unsigned char *p)
+{
+	unsigned char d;
+
+	// check first char
+	d = p[0];
+	if ((d==0x00)||(d==0x05)||(d==0x2e)||(d==0xe5)) return 0;
+	if (!(((d>='A')&&(d<='Z'))||((d>='0')&&(d<='9')))) return 0;
+	d = p[11];
+	if (d&0x1e) return 0;
+	if (d==0xf) return 0;
+	return 1;
+}
+
+// the extensions in the order coldMount() looks for them
+PROGMEM prog_uchar pickExt[21] = {
+	'C','A','T','N','I','C','D','S','K','W','O','Z','P','O',' ','H','D','V','2','M','G'};
+
+// the newest CAT file, else the newest image of the first extension
+// findExt() finds in coldMount(); the scan stops at the first entry
+// never used, so only the sectors in use are read
+unsigned short rootPick(void)
+{
+	unsigned char *p, k, rank = 7;
+	unsigned short i, pick = 512, tm, dt, max_time = 0, max_date = 0;
+
+	for (i=0; i!=512; i++) {
+		if (bit_is_set(PIND,3)) return 512;
+		p = readCache(rootAddr+(i>>4))+(i&0xf)*32;
+		if (!p[0]) break;
+		if (!fileEntry(p)) continue;
+		for (k=0; k<7; k++) {
+			if ((p[8]==pgm_read_byte_near(pickExt+k*3))&&
+				(p[9]==pgm_read_byte_near(pickExt+k*3+1))&&
+				(p[10]==pgm_read_byte_near(pickExt+k*3+2))) break;
+		}
+		if ((k==7)||(k>rank)) continue;
+		tm = *(unsigned short *)(p+22);
+		dt = *(unsigned short *)(p+24);
+		if ((k<rank)||(dt>max_date)||((dt==max_date)&&(tm>=max_time))) {
+			rank = k;
+			max_time = tm;
+			max_date = dt;
+			pick = i;
+		}
+	}
+	return pick;
+}
+
+// the catalog is the newest file with the CAT extension in the root
+// directory, as tools/catalog writes it: a header sector, the directory
+// table and 64 byte records of the images on the volume sorted by path,
+// 8 a sector; little endian
+//	header	"SDISKCAT", the record count at 10, the sector of the first
+//			record at 12, the volume serial number at 16
+//	record	the format at 0, the sector of its directory entry at 2 and
+//			the entry in it at 6, first cluster at 8, size at 10, path at 16
+#define CAT_NIC 1
+#define CAT_DSK 2
+#define CAT_WOZ 3
+#define CAT_PO 4
+#define CAT_2MG 5
+PROGMEM prog_uchar catMagic[8] = {'S','D','I','S','K','C','A','T'};
+
+// record idx of the catalog, the last one for 0xffff (SWITCH_PREV from the
+// first) and the first for any other past the end, kept in eeCatIndex; 0 if
+// there is no catalog or the directory entry no longer holds the first
+// cluster and size of the record
+unsigned char catMount(unsigned short idx, unsigned char *twoMg)
+{
+	unsigned char *p, fmt, ent;
+	unsigned short ft, num, rec;
+	unsigned long sec, size;
+
+	if (catCluster == 0xffff) {
+		// the entry kept in the EEPROM if it still is the catalog,
+		// else the newest one in the root directory
+		catCluster = catStart();
+		if (!catCluster) {
+			catDir = findExt("CAT", (unsigned char *)0, (unsigned char *)0);
+			catCluster = catStart();
+		}
+	}
+	ft = catCluster;
+	if (ft < 2) return 0;
+	p = readCache(userAddr+((unsigned long)(ft-2)<<sectorsPerCluster2));
+	num = *(unsigned short *)(p+10);
+	rec = *(unsigned short *)(p+12);
+	if (!num) return 0;
+	if (idx >= num) idx = ((idx==0xffff)?(num-1):0);
+
+	// the record, through the FAT as the file may be fragmented
+	rec += (idx>>3);
+	for (num = (rec>>sectorsPerCluster2); num; num--) {
+		if (bit_is_set(PIND,3)) return 0;
+		ft = fatEntry(ft, 1);
+		if ((ft < 2) || (ft > 0xfff6)) return 0;
+	}
+	p = readCache(userAddr+((unsigned long)(ft-2)<<sectorsPerCluster2)+
+		(rec&(sectorsPerCluster-1)))+(idx&7)*64;
+	fmt = p[0];
+	sec = (*(unsigned short *)(p+2)|((unsigned long)*(unsigned short *)(p+4)<<16));
+	ent = (p[6]&0xf);
+	ft = *(unsigned short *)(p+8);
+	size = (*(unsigned short *)(p+10)|((unsigned long)*(unsigned short *)(p+12)<<16));
+	if ((fmt < CAT_NIC) || (fmt > CAT_2MG)) return 0;
+	p = readCache(sec)+ent*32;
+	if ((p[0]==0x00)||(p[0]==0xe5)||(p[11]&0x18)||(*(unsigned short *)(p+26)!=ft)||
+		(*(unsigned short *)(p+28)!=(unsigned short)size)||
+		(*(unsigned short *)(p+30)!=(unsigned short)(size>>16))) return 0;
+	protect = ((p[11]&1)<<3);
+	dirAddr = sec;
+	switch (fmt) {
+	case CAT_NIC: nicDir = ent; break;
+	case CAT_DSK: dskDir = ent; dskMode = 1; break;
+	case CAT_WOZ: wozDir = ent; woz = 1; break;
+	case CAT_2MG: *twoMg = 1;	// and served as a PO image
+	case CAT_PO: blkDir = ent; smartPort = 1; break;
+	}
+	eeprom_update_block((const void *)&idx, (void *)&eeCatIndex, 2);
+	return 1;
+}
+
+// the first cluster of the catalog in catDir, 0 if it is not one of this
+// volume; its header is checked here, once a mount
+unsigned short catStart(void)
 {
+	unsigned char *p, serial[4], i;
 	unsigned short ft;
-	unsigned char fn;
 
-	if (bit_is_set(PIND,3)) return;
-	cmdFast(16, (unsigned long)2);
-	cmd17Fast(rootAddr+i*32+26);
-	ft = readByteFast();
-	ft += (unsigned short)readByteFast()*0x100;
-	readByteFast(); readByteFast(); // discard CRC bytes
-	if (0==fatNum) fat[0] = ft;
-	for (i=0; i<len; i++) {
-		fn = (i+1)/fatElemNum;
-		cmd17Fast((unsigned long)fatAddr+(unsigned long)ft*2);
-		ft = readByteFast();
-		ft += (unsigned short)readByteFast()*0x100;
+	if (catDir == 512) return 0;
+	p = readCache(rootAddr+(catDir>>4))+(catDir&0xf)*32;
+	if ((p[0]==0x00)||(p[0]==0xe5)||(p[11]&0x18)||(p[8]!='C')||(p[9]!='A')||(p[10]!='T'))
+		return 0;
+	ft = *(unsigned short *)(p+26);
+	if (ft < 2) return 0;
+	p = readCache(userAddr+((unsigned long)(ft-2)<<sectorsPerCluster2));
+	for (i=0; i<8; i++) if (p[i]!=pgm_read_byte_near(catMagic+i)) return 0;
+	memcp(serial, p+16, 4);
+	p = readCache(bpbAddr);
+	for (i=0; i<4; i++) if (serial[i]!=p[0x27+i]) return 0;
+	return ft;
+}
+
+// follow a cluster chain n links on
+unsigned short fatEntry(unsigned short ft, unsigned short n)
+{
+	unsigned short d, i, sec;
+
+	while (n) {
+		if (cacheOld!=CACHE_NUM) {
+			ft = *(unsigned short *)(readCache(fatAddr+(ft>>8))+(ft&0xff)*2);
+			n--;
+			continue;
+		}
+		// the cache is off, read through a whole sector; a chain mostly
+		// goes up, every link met further on in the sector is taken too
+		stopRead();
+		sec = (ft>>8);
+		cmd17Fast(fatAddr+sec);
+		for (i=0; i<256; i++) {
+			d = readByteFast();
+			d |= ((unsigned short)readByteFast()<<8);
+			if (n && (i==(ft&0xff)) && ((ft>>8)==sec)) {
+				ft = d;
+				n--;
+			}
+		}
 		readByteFast(); readByteFast(); // discard CRC bytes
-		if (fn==fatNum) fat[(i+1)%fatElemNum] = ft;
-		if ((ft>0xfff6)||(fn>fatNum)) break;
 	}
-	cmdFast(16, (unsigned long)512);	
+	return ft;
+}
+
+// build the cluster extent map of a file
+unsigned char buildExt(unsigned short dir, unsigned short *extLc, unsigned short *extFt,
+	unsigned short len)
+{
+	unsigned short ft, lc = 0;
+	unsigned char n = 0;
+
+	if (bit_is_set(PIND,3)) return 0;
+	ft = *(unsigned short *)(readCache(dirAddr+(dir>>4))+(dir&0xf)*32+26);
+	while (ft>=2) {
+		if ((n==0)||(ft!=extFt[n-1]+(lc-extLc[n-1]))) {
+			if (n==EXT_NUM) break;	// the rest is looked up in sectorAddr
+			extLc[n] = lc;
+			extFt[n++] = ft;
+		}
+		if (++lc==len) break;
+		ft = fatEntry(ft, 1);
+		if (ft>0xfff6) break;
+	}
+	extLc[n] = lc;
+	extLc[EXT_NUM+1] = 0xffff;
+	return n;
+}
+
+// get the SD card sector holding a sector of a mapped file
+unsigned long sectorAddr(unsigned short *extLc, unsigned short *extFt,
+	unsigned char extNum, unsigned short long_sector)
+{
+	unsigned short long_cluster = long_sector>>sectorsPerCluster2;
+	unsigned short ft;
+	unsigned char e = extNum-1;
+
+	if (long_cluster<extLc[extNum]) {
+		while (extLc[e]>long_cluster) e--;
+		ft = extFt[e]+(long_cluster-extLc[e]);
+	} else {
+		// too fragmented to be mapped, follow the FAT from the last extent
+		// or from where the previous walk stopped
+		unsigned short lc = extLc[EXT_NUM+1];
+
+		if (lc>long_cluster) {
+			lc = extLc[extNum]-1;
+			ft = extFt[e]+(lc-extLc[e]);
+		} else ft = extFt[EXT_NUM];
+		ft = fatEntry(ft, long_cluster-lc);
+		STAT(stats.fatWalks += long_cluster-lc);
+		extLc[EXT_NUM+1] = long_cluster;
+		extFt[EXT_NUM] = ft;
+	}
+	return userAddr+((unsigned long)(ft-2)<<sectorsPerCluster2)
+		+ (long_sector&(sectorsPerCluster-1));
 }
 
 // memory copy
@@ -463,285 +1199,474 @@ void memcp(unsigned char *dst, unsigned char *src, unsigned short len)
 	for (i=0; i<len; i++) dst[i]=src[i];
 }
 
-void writeSD(unsigned long adr, unsigned char *data, unsigned short len)
+void writeSD(unsigned long sec, unsigned short ofs, unsigned char *data, unsigned short len)
 {
-	unsigned int i;
-	unsigned char *buf = &writeData[0][0];
-
 	if (bit_is_set(PIND,3)) return;
 
-	cmdFast(16, 512);
-	cmd17Fast(adr&0xfffffe00);
-	for (i=0; i<512; i++) buf[i] = readByteFast();
+	// write through the metadata cache
+	memcp(readCache(sec)+ofs, data, len);
+	writeCache(sec);
+}
+
+// decode 342 nibbles and a checksum at p into 256 bytes at p+86,
+// returns 0 on a checksum error
+unsigned char decode62(unsigned char *p)
+{
+	unsigned char x = 0, a;
+	unsigned short i;
+
+	for (i = 0; i < 342; i++) {
+		x ^= pgm_read_byte_near(decTable+p[i]);
+		p[i] = x;
+	}
+	if (x != pgm_read_byte_near(decTable+p[342])) return 0;
+	for (i = 0; i < 256; i++) {
+		if (i < 86) a = p[i];
+		else if (i < 172) a = (p[i-86]>>2);
+		else a = (p[i-172]>>4);
+		p[i+86] = ((p[i+86]<<2) | pgm_read_byte_near(FlipBit+(a&3)));
+	}
+	return 1;
+}
+
+// the 6-bit value behind nibble i of 256 encoded bytes, nibble i is
+// encTable[x62(src,i)^x62(src,i-1)], the checksum 342 is encTable[x62(src,341)]
+unsigned char x62(unsigned char *src, unsigned short i)
+{
+	if (i < 86)
+		return (pgm_read_byte_near(FlipBit1+(src[i]&3)) |
+			pgm_read_byte_near(FlipBit2+(src[i+86]&3)) |
+			((i<=83)?pgm_read_byte_near(FlipBit3+(src[i+172]&3)):0));
+	if (i < 342) return (src[i-86] >> 2);
+	return 0;
+}
+
+// encode 256 bytes into 342 6-and-2 nibbles and a checksum,
+// src may be dst+87 or beyond, the nibbles go to the SD card if dst is 0
+void encode62(unsigned char *dst, unsigned char *src)
+{
+	unsigned char c, x, ox = 0;
+	unsigned short i;
+
+	for (i = 0; i < 343; i++) {
+		x = x62(src, i);
+		c = pgm_read_byte_near(encTable+(x^ox));
+		if (dst) dst[i] = c; else writeByteFast(c);
+		ox = x;
+	}
+}
+
+// byte i of the gap, address field and data prologue of a sector,
+// 0x38 bytes that come before the data field
+unsigned char headByte(unsigned char i, unsigned char trk, unsigned char sc)
+{
+	unsigned char c = (volume^trk^sc);
+
+	// 0x03 ends the 0xff bytes, then four 10-bit syncs every 5 bytes
+	if (i == 0x16) return 0x03;
+	if ((i > 0x16) && (i < 0x22)) return pgm_read_byte_near(syncTable+(i-0x17)%5);
+	switch (i) {
+	case 0x22: return 0xd5;
+	case 0x23: return 0xaa;
+	case 0x24: return 0x96;
+	case 0x25: return ((volume>>1)|0xaa);
+	case 0x26: return (volume|0xaa);
+	case 0x27: return ((trk>>1)|0xaa);
+	case 0x28: return (trk|0xaa);
+	case 0x29: return ((sc>>1)|0xaa);
+	case 0x2a: return (sc|0xaa);
+	case 0x2b: return ((c>>1)|0xaa);
+	case 0x2c: return (c|0xaa);
+	case 0x2d: return 0xde;
+	case 0x2e: return 0xaa;
+	case 0x2f: return 0xeb;
+	case 0x35: return 0xd5;
+	case 0x36: return 0xaa;
+	case 0x37: return 0xad;
+	}
+	return 0xff;
+}
+
+// read a sector of the DSK image into readData
+void readDsk(unsigned char trk, unsigned char sc)
+{
+	unsigned char logic_sector = pgm_read_byte_near(logicalSector+sc);
+	unsigned short i, long_sector = (unsigned short)trk*8+(logic_sector/2);
+
+	// a DSK block holds two logical sectors, keep one of them
+	cmd17Fast(sectorAddr(imgExtLc, imgExtFt, imgExtNum, long_sector));
+	if (logic_sector&1) for (i=0; i<256; i++) readByteFast();
+	for (i=0; i<256; i++) readData[i]=readByteFast();
+	if (!(logic_sector&1)) for (i=0; i<256; i++) readByteFast();
 	readByteFast(); readByteFast(); // discard CRC bytes
-	memcp(&(buf[adr&0x1ff]), data, len);
-	
-	PORTD = 0b00000010;
-	PORTD = 0b00000000;	
-				
-	cmdFast(24,adr&0xfffffe00);		
-	writeByteFast(0xff);
-	writeByteFast(0xfe);
-	for (i=0; i<512; i++) writeByteFast(buf[i]);
-	writeByteFast(0xff);
-	writeByteFast(0xff);
-	readByteFast();
-	waitFinish();
-	
-	PORTD = 0b00000010;
-	PORTD = 0b00000000;	
 }
 
-void duplicateFat(void)
+// read n bytes of the image at ofs, they don't cross a sector
+void readImg(unsigned long ofs, unsigned char *dst, unsigned char n)
 {
-	unsigned short i, j;
-	unsigned long adr = fatAddr;
-	unsigned char *buf = &writeData[0][0];
+	unsigned short i, o = (ofs&511);
 
-	if (bit_is_set(PIND,3)) return;
+	stopRead();
+	cmd17Fast(sectorAddr(imgExtLc, imgExtFt, imgExtNum, ofs>>9));
+	for (i=0; i<514; i++) {
+		unsigned char c = readByteFast();
+		if ((i>=o)&&(i<o+n)) *dst++ = c;
+	}
+}
 
-	cmdFast(16, 512);
-	for (j=0; j<sectorsPerFat; j++) {
-		cmd17Fast(adr);
-		for (i=0; i<512; i++) buf[i] = readByteFast();
+// look a quarter track up in TMAP and TRKS, the stream is stopped;
+// the head keeps its angle on the new track
+void wozTrack(unsigned char qt)
+{
+	unsigned char e[8];
+	unsigned short bits = trkBits;
+
+	fillTrk = qt;
+	readImg(88+qt, e, 1);
+	if (e[0]==0xff) trkBits = 0;
+	else if (woz==1) {
+		// 6646 bytes of bits, the bytes used and the bit count follow
+		trkStart = 256+(unsigned long)e[0]*6656;
+		readImg(trkStart+6648, e, 2);
+		trkBits = *(unsigned short *)e;
+	} else {
+		// starting block, block count and bit count, 32 bits but a 5.25"
+		// track is under 64K bits
+		readImg(256+(unsigned short)e[0]*8, e, 8);
+		trkStart = ((unsigned long)*(unsigned short *)e<<9);
+		trkBits = *(unsigned short *)(e+4);
+	}
+	if (bits && trkBits) wozBit = ((unsigned long)wozBit*trkBits/bits)&~7;
+	else wozBit = 0;
+}
+
+// finish the sector being read, the stream goes on from ofs
+void wozSeek(unsigned long ofs)
+{
+	for (; wozOff<514; wozOff++) readByteFast();
+	wozBlk = (ofs>>9);
+	cmd18Fast(sectorAddr(imgExtLc, imgExtFt, imgExtNum, wozBlk));
+	for (wozOff=0; wozOff<(ofs&511); wozOff++) readByteFast();
+}
+
+// the next byte of the WOZ stream, the multiple block read
+// goes on to the next sector of the image
+unsigned char readWoz(void)
+{
+	if (wozOff == 512) {
 		readByteFast(); readByteFast(); // discard CRC bytes
+		cmd18Fast(sectorAddr(imgExtLc, imgExtFt, imgExtNum, ++wozBlk));
+		wozOff = 0;
+	}
+	wozOff++;
+	return readByteFast();
+}
+
+// the next 8 bits of the track as they pass under the head, MSB first,
+// the stream starts again at the beginning after the last bit;
+// no bits at all where TMAP has no track
+unsigned char wozFill(void)
+{
+	unsigned char c = 0, i;
+
+	if (!trkBits) return 0;
+	for (i=0; i<8; i++) {
+		if (!(wozBit&7)) {
+			if ((wozOff==514)||!wozBit) wozSeek(trkStart+(wozBit>>3));
+			wozByte = readWoz();
+		}
+		c = ((c<<1)|(wozByte>>7));
+		wozByte <<= 1;
+		if (++wozBit == trkBits) wozBit = 0;
+	}
+	return c;
+}
+
+// read block bn of the SmartPort image into spBlock, a 2MG block
+// straddles two sectors
+void spReadBlock(unsigned short bn)
+{
+	unsigned long ofs = spOfs+((unsigned long)bn<<9);
+	unsigned short i, o = (ofs&511);
+	unsigned char s;
+
+	stopRead();
+	for (s=0; s<(o?2:1); s++) {
+		if (bit_is_set(PIND,3)) return;
+		cmd17Fast(sectorAddr(imgExtLc, imgExtFt, imgExtNum, (ofs>>9)+s));
+		for (i=0; i<514; i++) {
+			unsigned char c = readByteFast();
+			if (!s && (i>=o) && (i<512)) spBlock[i-o] = c;
+			if (s && (i<o)) spBlock[512-o+i] = c;
+		}
+	}
+}
+
+// write spBlock back to block bn of the SmartPort image, the sectors a 2MG
+// block straddles are read into writeData and merged with it
+void spWriteBlock(unsigned short bn)
+{
+	unsigned long ofs = spOfs+((unsigned long)bn<<9), adr;
+	unsigned short i, o = (ofs&511);
+	unsigned char s, *p = spBlock;
+
+	stopRead();
+	for (s=0; s<(o?2:1); s++) {
+		if (bit_is_set(PIND,3)) return;
+		adr = sectorAddr(imgExtLc, imgExtFt, imgExtNum, (ofs>>9)+s);
+		if (o) {
+			cmd17Fast(adr);
+			for (i=0; i<512; i++) writeData[i] = readByteFast();
+			readByteFast(); readByteFast(); // discard CRC bytes
+			if (s) memcp(writeData, spBlock+512-o, o);
+			else memcp(writeData+o, spBlock, 512-o);
+			p = writeData;
+		}
 
 		PORTD = 0b00000010;
-		PORTD = 0b00000000;	
-		
-		cmdFast(24,adr+(unsigned long)sectorsPerFat*512);		
+		PORTD = 0b00000000;
+
+		cmdSector(24, adr);
 		writeByteFast(0xff);
 		writeByteFast(0xfe);
-		for (i=0; i<512; i++) writeByteFast(buf[i]);
-		writeByteFast(0xff);
-		writeByteFast(0xff);
-		readByteFast();
-		waitFinish();
-		adr += 512;
-		
+		for (i=0; i<512; i++) writeByteFast(p[i]);
+		writeBlockEnd();
+
 		PORTD = 0b00000010;
-		PORTD = 0b00000000;	
+		PORTD = 0b00000000;
 	}
 }
 
-// create a NIC image file
-int createNic(unsigned char *name)
+// decode the packet captured in writeData into dst: the odd bytes, then
+// groups of 7, each after a byte holding their top bits; returns the
+// length, 0xffff if the packet was cut off, is longer than max or its
+// checksum is wrong
+unsigned short spDecode(unsigned char *dst, unsigned short max)
 {
-	unsigned short re, clusterNum;
-	unsigned long ft, adr;
-	unsigned short d, i;
-	unsigned char c, dirEntry[32], at;
-	static unsigned char last[2] = {0xff, 0xff};
+	unsigned char *p = writeData+8, chk = 0, odd = (writeData[6]&0x7f), k, j, m;
+	unsigned short i, n = odd+(unsigned short)(writeData[7]&0x7f)*7;
+
+	if ((n>max) || (8+n+(n+6)/7+3>writeMax)) return 0xffff;
+	// the header from DEST to GRP7CNT is in the checksum too
+	for (i=1; i<8; i++) chk ^= writeData[i];
+	for (i=0; i<n; i+=k) {
+		k = ((i||!odd)?7:odd);
+		m = *p++;
+		for (j=0; j<k; j++) {
+			dst[i+j] = ((*p++&0x7f)|((m<<(1+j))&0x80));
+			chk ^= dst[i+j];
+		}
+	}
+	if (chk != ((p[0]&0x55)|((p[1]<<1)&0xaa))) return 0xffff;
+	return n;
+}
 
-	if (bit_is_set(PIND,3)) return 0;
-	
-	for (i=0; i<32; i++) dirEntry[i]=0;
-	memcp(dirEntry, name, 8);
-	memcp(dirEntry+8, (unsigned char *)"NIC", 3);
-	*(unsigned long *)(dirEntry+28) = (unsigned long)286720;
-	
-	// search a root directory entry
-	for (re=0; re<512; re++) {
-		cmdFast(16, 1);
-		cmd17Fast(rootAddr+re*32+0);
-		c = readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-		cmd17Fast(rootAddr+re*32+11);
-		at = readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if (((c==0xe5)||(c==0x00))&&(at!=0xf)) break;  // find a RDE!
-	}	
-	if (re==512) return 0;
-	// write a directory entry
-	writeSD(rootAddr+re*32, dirEntry, 32);	
-	// search the first fat entry
-	adr = (rootAddr+re*32+26);
-	clusterNum = 0;
-	for (ft=2;
-		(clusterNum<((560+sectorsPerCluster-1)>>sectorsPerCluster2)); ft++) {
-		cmdFast(16, 2);
-		cmd17Fast(fatAddr+ft*2);
-		d = readByteFast();
-		d += (unsigned short)readByteFast()*0x100;
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if (d==0) {
-			clusterNum++;
-			writeSD(adr, (unsigned char *)&ft, 2);
-			adr = fatAddr+ft*2;
+// build a packet to the host in writeData, n bytes of spBlock after the
+// sync bytes, the packet begin mark and the header
+unsigned short spEncode(unsigned char type, unsigned char stat, unsigned short n)
+{
+	unsigned char *p = writeData, chk = 0, odd = (n%7), k, j, m;
+	unsigned short i;
+
+	for (i=0; i<6; i++) *p++ = pgm_read_byte_near(spSync+i);
+	*p++ = 0xc3;
+	*p++ = 0x80;				// DEST, the host
+	*p++ = (spId|0x80);			// SRC
+	*p++ = type;
+	*p++ = 0x80;				// AUX
+	*p++ = (stat|0x80);
+	*p++ = (odd|0x80);
+	*p++ = ((n/7)|0x80);
+	for (i=7; i<14; i++) chk ^= writeData[i];
+	for (i=0; i<n; i+=k) {
+		k = ((i||!odd)?7:odd);
+		for (m=0x80, j=0; j<k; j++) {
+			m |= ((spBlock[i+j]&0x80)>>(1+j));
+			chk ^= spBlock[i+j];
 		}
+		*p++ = m;
+		for (j=0; j<k; j++) *p++ = (spBlock[i+j]|0x80);
 	}
-	writeSD(adr, last, 2);
-	duplicateFat();
-	return 1;
+	*p++ = (chk|0xaa);
+	*p++ = ((chk>>1)|0xaa);
+	*p++ = 0xc8;				// packet end mark
+	return (p-writeData);
 }
 
-// translate a DSK image into a NIC image
-void dsk2Nic(void)
+// take the packet captured in writeData: a command is decoded into readRing,
+// the data packet of a WRITEBLOCK or CONTROL (data) into spBlock; INIT is
+// taken while there is no id, anything else only if it is for our id
+unsigned char spTake(unsigned char data)
 {
-	unsigned char trk, logic_sector;
+	unsigned char dest = (writeData[1]&0x7f);
+	unsigned short n;
+
+	if (data) {
+		if (writeData[3] != 0x82) return 0;
+		if (!spId || (dest != spId)) return 0;
+		// the command is still in readRing, a block must come whole
+		n = spDecode(spBlock, 512);
+		return ((n != 0xffff) && ((readRing[0] != 2) || (n == 512)));
+	}
+	if (writeData[3] != 0x80) return 0;
+	if (spDecode(readRing, RING) == 0xffff) return 0;
+	if (readRing[0] == 5) return (!spId || (dest == spId));
+	return (spId && (dest == spId));
+}
 
-	unsigned short i;
-	unsigned char *dst = (&writeData[0][0]+512);
-	unsigned short *fatDsk = (unsigned short *)(&writeData[0][0]+1024);
-
-	PORTB |= 0b00010000;
-
-	prevFatNumNic = prevFatNumDsk = 0xff;
-
-	for (i=0; i<0x16; i++) dst[i]=0xff;
-
-	// sync header
-	dst[0x16]=0x03;
-	dst[0x17]=0xfc;
-	dst[0x18]=0xff;
-	dst[0x19]=0x3f;
-	dst[0x1a]=0xcf;
-	dst[0x1b]=0xf3;
-	dst[0x1c]=0xfc;
-	dst[0x1d]=0xff;
-	dst[0x1e]=0x3f;
-	dst[0x1f]=0xcf;
-	dst[0x20]=0xf3;
-	dst[0x21]=0xfc;	
-	
-	// address header
-	dst[0x22]=0xd5;
-	dst[0x23]=0xaa;
-	dst[0x24]=0x96;
-	dst[0x2d]=0xde;
-	dst[0x2e]=0xaa;
-	dst[0x2f]=0xeb;
-	
-	// sync header
-	for (i=0x30; i<0x35; i++) dst[i]=0xff;
-	
-	// data
-	dst[0x35]=0xd5;
-	dst[0x36]=0xaa;
-	dst[0x37]=0xad;
-	dst[0x18f]=	0xde;
-	dst[0x190]=0xaa;
-	dst[0x191]=0xeb;
-	for (i=0x192; i<0x1a0; i++) dst[i]=0xff;
-	for (i=0x1a0; i<0x200; i++) dst[i]=0x00;	
-
-	cmdFast(16, (unsigned long)512);	
-	for (trk = 0; trk < 35; trk++) {
-		PORTB ^= 0b00010000;
-		for (logic_sector = 0; logic_sector < 16; logic_sector++) {
-			unsigned char *src;
-			unsigned short ph_sector = (unsigned short)pgm_read_byte_near(physicalSector+logic_sector);
+// run the command in readRing, the response is left in writeData;
+// a WRITEBLOCK or CONTROL returns 0 until its data packet is taken (data)
+unsigned short spExec(unsigned char data)
+{
+	unsigned char *c = readRing, i;
+	unsigned short bn = (c[4]|((unsigned short)c[5]<<8));
+
+	switch (c[0]) {
+	case 0:		// STATUS, the device status or the DIB
+		spBlock[0] = (protect?0xfc:0xf8);	// block device, on line, write protected
+		spBlock[1] = (spBlocks&0xff);
+		spBlock[2] = (spBlocks>>8);
+		spBlock[3] = 0;
+		if (c[4] == 0) return spEncode(0x81, 0, 4);
+		if (c[4] != 3) return spEncode(0x81, 0x21, 0);
+		for (i=0; i<21; i++) spBlock[4+i] = pgm_read_byte_near(spDib+i);
+		return spEncode(0x81, 0, 25);
+	case 1:		// READBLOCK
+		if (c[6] || (bn >= spBlocks)) return spEncode(0x81, 0x2d, 0);
+		spReadBlock(bn);
+		return spEncode(0x82, 0, 512);
+	case 2:		// WRITEBLOCK
+		if (!data) return 0;
+		if (c[6] || (bn >= spBlocks)) return spEncode(0x81, 0x2d, 0);
+		if (protect) return spEncode(0x81, 0x2b, 0);
+		spWriteBlock(bn);
+		return spEncode(0x81, 0, 0);
+	case 3:		// FORMAT, there is nothing to do
+		return spEncode(0x81, 0, 0);
+	case 4:		// CONTROL, the control list is dropped
+		if (!data) return 0;
+		return spEncode(0x81, 0, 0);
+	case 5:		// INIT, we are the last device on the bus
+		spId = (writeData[1]&0x7f);
+		return spEncode(0x81, 0x7f, 0);
+	}
+	return spEncode(0x81, 0x01, 0);
+}
 
-			if (bit_is_set(PIND,3)) return;
+// send len bytes of writeData out of readRing, __vector_16 starts once the
+// ring is full or all of them are in and stops after the last bit
+void spSend(unsigned short len)
+{
+	unsigned short i = 0, ahead;
+	unsigned char done;
 
-			if ((logic_sector&1)==0) {
-				unsigned short long_sector = (unsigned short)trk*8+(logic_sector/2);
-				unsigned short long_cluster = long_sector>>sectorsPerCluster2;
-				unsigned char fatNum = long_cluster/FAT_DSK_ELEMS;
-				unsigned short ft;
+	cancelRead();
+	while (i < len) {
+		if (bit_is_set(PIND,3)) return;
+		cli();
+		ahead = bitLimit-bitbyte;
+		if (ahead == RING*8) prepare = 0;
+		sei();
+		if (ahead >= RING*8) continue;
+		*fillPtr++ = writeData[i++];
+		if (fillPtr == readRing+RING) fillPtr = readRing;
+		cli();
+		bitLimit += 8;
+		sei();
+	}
+	prepare = 0;
+	do {
+		if (bit_is_set(PIND,3)) return;
+		cli();
+		done = prepare;
+		sei();
+	} while (!done);
+}
 
-				if (fatNum != prevFatNumDsk) {
-					prevFatNumDsk = fatNum;						
-					prepareFat(dskDir, fatDsk,
-						(280+sectorsPerCluster-1)>>sectorsPerCluster2, fatNum, FAT_DSK_ELEMS);	
-				}
-				ft = fatDsk[long_cluster%FAT_DSK_ELEMS];
-				cmd17Fast((unsigned long)userAddr+(((unsigned long)(ft-2)<<sectorsPerCluster2)
-					+ (long_sector&(sectorsPerCluster-1)))*(unsigned long)512);
-				for (i=0; i<512; i++) {
-					if (bit_is_set(PIND,3)) return;
-					*(&writeData[0][0]+i)=readByteFast();
-				}
-				readByteFast(); readByteFast(); // discard CRC bytes				
-				src = &writeData[0][0];
-			} else {
-				src = (&writeData[0][0]+256);
-			}
-			{
-				unsigned char c, x, ox = 0;
-
-				dst[0x25]=((volume>>1)|0xaa);
-				dst[0x26]=(volume|0xaa);
-				dst[0x27]=((trk>>1)|0xaa);
-				dst[0x28]=(trk|0xaa);
-				dst[0x29]=((ph_sector>>1)|0xaa);
-				dst[0x2a]=(ph_sector|0xaa);
-				c = (volume^trk^ph_sector);
-				dst[0x2b]=((c>>1)|0xaa);
-				dst[0x2c]=(c|0xaa);
-				for (i = 0; i < 86; i++) {
-					x = (pgm_read_byte_near(FlipBit1+(src[i]&3)) |
-						pgm_read_byte_near(FlipBit2+(src[i+86]&3)) |
-						((i<=83)?pgm_read_byte_near(FlipBit3+(src[i+172]&3)):0));
-					dst[i+0x38] = pgm_read_byte_near(encTable+(x^ox));
-					ox = x;
-				}
-				for (i = 0; i < 256; i++) {
-					x = (src[i] >> 2);
-					dst[i+0x8e] = pgm_read_byte_near(encTable+(x^ox));
-					ox = x;
-				}
-				dst[0x18e]=pgm_read_byte_near(encTable+ox);
-			}
-			{
-				unsigned char c, d;
-				unsigned short long_sector = (unsigned short)trk*16+ph_sector;
-				unsigned short long_cluster = long_sector>>sectorsPerCluster2;
-				unsigned char fatNum = long_cluster/FAT_NIC_ELEMS;
-				unsigned short ft;
-			
-				if (fatNum != prevFatNumNic) {
-					prevFatNumNic = fatNum;
-					prepareFat(nicDir, fatNic,
-						(560+sectorsPerCluster-1)>>sectorsPerCluster2, fatNum, FAT_NIC_ELEMS);
-				}
-				ft = fatNic[long_cluster%FAT_NIC_ELEMS];
-
-				PORTD = 0b00000010;
-				PORTD = 0b00000000;
-
-				cmdFast(24, userAddr+(((unsigned long)(ft-2)<<sectorsPerCluster2)
-					+ (long_sector&(sectorsPerCluster-1)))*(unsigned long)512);
-				writeByteFast(0xff);
-				writeByteFast(0xfe);
-				for (i = 0; i < 512; i++) {
-					register unsigned char D1=0b00010000, D2=0b00110000, D3=0b00000000, D4=0b00100000;
-					if (bit_is_set(PIND,3)) return;
-					c = dst[i];
-					for (d = 0b10000000; d; d >>= 1) {
-						if (c&d) {
-							PORTD = D1;
-							PORTD = D2;
-						} else {
-							PORTD = D3;
-							PORTD = D4;
-						}
-					}
-				}
-				PORTD = 0b00000000;
-				writeByteFast(0xff);
-				writeByteFast(0xff);
-				readByteFast();
-				waitFinish();
-				
-				PORTD = 0b00000010;
-				PORTD = 0b00000000;	
-			}
-		}
+// the bus is enabled by PHASE-1 and PHASE-3 and the card is in,
+// PHASE-0 and PHASE-2 alone reset it
+unsigned char spAlive(void)
+{
+	unsigned char b = (PINB&0b00001111);
+
+	if (b == 0b00000101) spId = 0;
+	return (bit_is_clear(PIND,3) && ((b&0b00001010) == 0b00001010));
+}
+
+// a packet is taken with ACK low until the host lets go of REQ; ACK goes
+// high when the response is ready, it is sent once REQ is high, ACK low
+// after it until REQ is low again; a data packet is taken like a command
+void spBus(void)
+{
+	unsigned short n;
+
+	if (!spAlive()) {
+		spRecv = 0;
+		protect = 8;
+		PORTB = 0b00100000;	// LED off
+		return;
 	}
-	buffClear();
-	PORTB &= 0b11101111;
+	PORTB = 0b00110000;		// LED on
+	if (!spRecv) return;
+	spRecv = 0;
+	if (!spTake(0)) return;
+	protect = 0;
+	while (bit_is_set(PINB,0)) if (!spAlive()) return;
+	n = spExec(0);
+	if (!n) {
+		protect = 8;
+		while (!spRecv) if (!spAlive()) return;
+		spRecv = 0;
+		if (!spTake(1)) return;
+		protect = 0;
+		while (bit_is_set(PINB,0)) if (!spAlive()) return;
+		n = spExec(1);
+	}
+	protect = 8;
+	while (bit_is_clear(PINB,0)) if (!spAlive()) return;
+	spSend(n);
+	protect = 0;
+	while (bit_is_set(PINB,0)) if (!spAlive()) return;
+	protect = 8;
+}
+
+#ifdef STATS
+// write the counters to the first sector of the STA file through the
+// metadata cache, which takes the first two write buffers: the drive is
+// off and no sector is buffered; the directory entry is checked first,
+// the file may be gone since the mount; the ring is filled again after
+void saveStats(void)
+{
+	unsigned char *p;
+	unsigned short ft;
+
+	if ((statsDir == 512) || buffNum || smartPort) return;
+	diskIntOff();
+	cancelRead();
+	stopRead();
+	cacheClear(0);
+	p = readCache(rootAddr+(statsDir>>4))+(statsDir&0xf)*32;
+	ft = *(unsigned short *)(p+26);
+	if ((p[0]!=0xe5)&&(p[8]=='S')&&(p[9]=='T')&&(p[10]=='A')&&(ft>=2)&&
+		(*(unsigned short *)(p+28)|*(unsigned short *)(p+30))) {
+		stats.saves++;
+		writeSD(userAddr+((unsigned long)(ft-2)<<sectorsPerCluster2), 0,
+			(unsigned char *)&stats, sizeof(stats));
+	}
+	cacheClear(1);
+	diskIntOn();
 }
+#endif
 
 // initialization called from check_eject
 void init(void)
 {
 	unsigned char ch;
 	unsigned short i;
-	char str[5];
-	unsigned char filebase[8];
+	unsigned long hcs = 0;
 
 	inited = 0;
+	streamAdr = 0xffffffff;
 	PORTB = 0b00110000;	// LED on
 
 	// initialize the SD card
@@ -760,6 +1685,18 @@ void init(void)
 		ch = readByteSlow();
 	} while (ch != 0x01);
 
+	// command 8, version 2 cards accept HCS in command 41
+	PORTD = 0b00000010;
+	PORTD = 0b00000000;
+	cmd_(8, 0x1aa);
+	ch = getRespSlow();
+	if (ch == 0xff) return;
+	if (!(ch & 0x04)) {
+		readByteSlow(); readByteSlow(); readByteSlow();
+		if (readByteSlow() != 0xaa) return;
+		hcs = 0x40000000;
+	}
+
 	PORTD = 0b00000010;
 	while (1) {
 		if (bit_is_set(PIND,3)) return;
@@ -771,94 +1708,291 @@ void init(void)
 		// if (ch == 0x00) break;
 		PORTD = 0b00000010;
 		PORTD = 0b00000000;
-		cmd_(41, 0);	// command 41	
+		cmd_(41, hcs);	// command 41	
 		if (!(ch=getRespSlow())) break;
 		if (ch == 0xff) return;
 		PORTD = 0b00000010;
 	}
 
+	// command 58, CCS bit tells block addressing
+	sdhc = 0;
+	if (hcs) {
+		PORTD = 0b00000010;
+		PORTD = 0b00000000;
+		cmd_(58, 0);
+		if (getRespSlow()) return;
+		sdhc = ((readByteSlow()&0x40)!=0);
+		readByteSlow(); readByteSlow(); readByteSlow();
+	}
+
+	// whole sectors are read from here on
+	cmdFast(16, (unsigned long)512);
+	cacheClear(0);
+
+	// a card mounted before is checked against the EEPROM in two sector reads
+	if (!warmMount()) {
+		if (!coldMount()) return;
+		STAT(statsDir = findExt("STA", (unsigned char *)0, (unsigned char *)0));
+		saveMount();
+	}
+	startDrive();
+}
+
+// nothing is buffered or read ahead for the image just mapped, the head
+// stays where it is
+void startDrive(void)
+{
+	readData = writeBuf(BUF_NUM-1);
+	
+	readPulse = 0;
+	magState = 0;
+	sector = 0;
+	buffNum = 0;
+	formatting = 0;
+	restart = 0;
+	// a SmartPort packet is captured whole from its packet begin mark,
+	// the block and its encoding fit below spBlock
+	writePtr = (smartPort?writeData:writeBuf(buffNum));
+	writeMax = (smartPort?600:349);
+	writeStart = (smartPort?0xc3:0xd5);
+	spRecv = 0;
+	cacheClear(1);
+	buffClear();
+	fillPos = 0;
+	wozOff = 514;
+	trkBits = wozBit = 0;
+	cancelRead();
+	if (woz) wozTrack(ph_track);
+	inited = 1;
+}
+
+// mount the FAT volume and map the newest image, 0 if there is none
+unsigned char coldMount(void)
+{
+	unsigned char *p;
+	unsigned short idx;
+	unsigned char twoMg = 0;
+
 	// BPB address
-	cmdFast(16,5);
-	cmd17Fast(54);
-	for (i=0; i<5; i++) str[i] = readByteFast();
-	readByteFast(); readByteFast(); // discard CRC
-	if ((str[0]=='F')&&(str[1]=='A')&&(str[2]=='T')&&
-		(str[3]=='1')&&(str[4]=='6')) {
+	p = readCache(0);
+	if ((p[54]=='F')&&(p[55]=='A')&&(p[56]=='T')&&
+		(p[57]=='1')&&(p[58]=='6')) {
 		bpbAddr = 0;
 	} else {
-		cmdFast(16, 4);
-		cmd17Fast((unsigned long)0x1c6);
-		bpbAddr = readByteFast();
-		bpbAddr += (unsigned long)readByteFast()*0x100;
-		bpbAddr += (unsigned long)readByteFast()*0x10000;
-		bpbAddr += (unsigned long)readByteFast()*0x1000000;
-		bpbAddr *= 512;
-		readByteFast(); readByteFast(); // discard CRC bytes
+		bpbAddr = *(unsigned short *)(p+0x1c6)|((unsigned long)*(unsigned short *)(p+0x1c8)<<16);
 	}
-	if (bit_is_set(PIND,3)) return;
+	if (bit_is_set(PIND,3)) return 0;
 
 	// sectorsPerCluster and reservedSectors
 	{
 		unsigned short reservedSectors;
 		volatile unsigned char k;
-		cmdFast(16, 3);
-		cmd17Fast(bpbAddr+0xd);
-		sectorsPerCluster = k = readByteFast();
+		p = readCache(bpbAddr);
+		sectorsPerCluster = k = p[0xd];
 		sectorsPerCluster2 = 0;
 			while (k != 1) {
 			sectorsPerCluster2++;
 			k >>= 1;
 		}
-		reservedSectors = readByteFast();
-		reservedSectors += (unsigned short)readByteFast()*0x100;
-		readByteFast(); readByteFast(); // discard CRC bytes	
+		reservedSectors = *(unsigned short *)(p+0xe);
 		// sectorsPerCluster = 0x40 at 2GB, 0x10 at 512MB
 		// reservedSectors = 2 at 2GB
-		fatAddr = bpbAddr + (unsigned long)512*reservedSectors;
+		fatAddr = bpbAddr + reservedSectors;
 	}
-	if (bit_is_set(PIND,3)) return;
+	if (bit_is_set(PIND,3)) return 0;
 
 	{
 		// sectorsPerFat and rootAddr
-		cmdFast(16, 2);
-		cmd17Fast(bpbAddr+0x16);
-		sectorsPerFat = readByteFast();
-		sectorsPerFat += (unsigned short)readByteFast()*0x100;
-		readByteFast(); readByteFast(); // discard CRC bytes		
+		sectorsPerFat = *(unsigned short *)(p+0x16);
 		// sectorsPerFat =  at 512MB,  0xEF at 2GB
-		rootAddr = fatAddr + ((unsigned long)sectorsPerFat*2*512);
-		userAddr = rootAddr+(unsigned long)512*32;
+		rootAddr = fatAddr + (unsigned long)sectorsPerFat*2;
+		userAddr = rootAddr+32;
 	}
-	if (bit_is_set(PIND,3)) return;
+	if (bit_is_set(PIND,3)) return 0;
 
-	// find "NIC" extension
-	nicDir = findExt("NIC", &protect, (unsigned char *)0);
-	if (nicDir == 512) { // create NIC file if not exists
-		// find "DSK" extension
-		dskDir = findExt("DSK", (unsigned char *)0, filebase);
-		if (dskDir == 512) return;
-		if (!createNic(filebase)) return;
+	nicDir = dskDir = wozDir = blkDir = 512;
+	dskMode = woz = smartPort = spLock = 0;
+	spOfs = 0;
+	dirAddr = rootAddr;
+	catDir = 512;
+	catCluster = 0xffff;
+	// the image the catalog has, else the newest in the root directory
+	eeprom_read_block((void *)&idx, (const void *)&eeCatIndex, 2);
+	// the EEPROM of a new unit is erased, it starts at the first record
+	if (idx == 0xffff) idx = 0;
+	if (!catMount(idx, &twoMg)) {
+		// find "NIC" extension
 		nicDir = findExt("NIC", &protect, (unsigned char *)0);
-		if (nicDir == 512) return;
-		// convert DSK image to NIC image
-		dsk2Nic();
+		if (nicDir == 512) { // serve a DSK file if no NIC file exists
+			dskDir = findExt("DSK", &protect, (unsigned char *)0);
+			dskMode = (dskDir != 512);
+		}
+		if ((nicDir == 512) && (dskDir == 512)) { // and a WOZ file if neither exists
+			wozDir = findExt("WOZ", &protect, (unsigned char *)0);
+			if (wozDir != 512) woz = 1;
+			else {
+				// and a block image on the SmartPort bus if there is no disk image
+				blkDir = findExt("PO ", &protect, (unsigned char *)0);
+				if (blkDir == 512) blkDir = findExt("HDV", &protect, (unsigned char *)0);
+				if (blkDir == 512) {
+					blkDir = findExt("2MG", &protect, (unsigned char *)0);
+					twoMg = 1;
+				}
+				if (blkDir == 512) return 0;
+				smartPort = 1;
+			}
+		}
 	}
-	if (bit_is_set(PIND,3)) return;
-	
-	prevFatNumNic = 0xff;
-	prevFatNumDsk = 0xff;
-	bitbyte = 0;
-	readPulse = 0;
-	magState = 0;
-	prepare = 1;
+	if (bit_is_set(PIND,3)) return 0;
+	if (!mapImage(twoMg)) return 0;
 	ph_track = 0;
-	sector = 0;
-	buffNum = 0;
-	formatting = 0;
-	writePtr = &(writeData[buffNum][0]);
-	cmdFast(16, (unsigned long)512);
-	buffClear();
-	inited = 1;
+	return 1;
+}
+
+// the extent map of the image in nicDir, dskDir, wozDir or blkDir, and
+// the header of a 2MG or WOZ image
+unsigned char mapImage(unsigned char twoMg)
+{
+	unsigned char *p;
+	unsigned short len;
+	unsigned long size = 0;
+
+	len = (dskMode?280:560);
+	if (woz || smartPort) {
+		// the tracks or blocks are as many as they are, map the whole file;
+		// its sectors are counted in 16 bits
+		p = readCache(dirAddr+((woz?wozDir:blkDir)>>4))+((woz?wozDir:blkDir)&0xf)*32;
+		size = (*(unsigned short *)(p+28)|((unsigned long)*(unsigned short *)(p+30)<<16));
+		if (size > 0xffffUL*512) size = 0xffffUL*512;
+		len = ((size+511)>>9);
+		if (smartPort) spBlocks = (size>>9);
+	}
+
+	// map the image once, no FAT access is needed after this
+	imgExtNum = buildExt(smartPort?blkDir:(woz?wozDir:(dskMode?dskDir:nicDir)),
+		imgExtLc, imgExtFt, (len+sectorsPerCluster-1)>>sectorsPerCluster2);
+	if (!imgExtNum) return 0;
+	if (twoMg) {
+		// a ProDOS order 2MG image, the blocks follow the header
+		p = readCache(sectorAddr(imgExtLc, imgExtFt, imgExtNum, 0));
+		if ((p[0]!='2')||(p[1]!='I')||(p[2]!='M')||(p[3]!='G')||(p[12]!=1)||
+			p[0x1a]||p[0x1b]) return 0;
+		spOfs = *(unsigned short *)(p+0x18);
+		if ((size<spOfs)||*(unsigned short *)(p+0x16)||
+			(*(unsigned short *)(p+0x14)>((size-spOfs)>>9))) return 0;
+		spBlocks = *(unsigned short *)(p+0x14);
+		spLock = (p[0x13]>>7);
+		if (spLock) protect = 8;
+	}
+	if (woz) {
+		// WOZ1 or WOZ2 with TMAP and TRKS where the specification puts
+		// them, written tracks are not kept so it is write protected
+		p = readCache(sectorAddr(imgExtLc, imgExtFt, imgExtNum, 0));
+		if ((p[0]!='W')||(p[1]!='O')||(p[2]!='Z')||((p[3]!='1')&&(p[3]!='2'))||
+			(p[80]!='T')||(p[81]!='M')||(p[82]!='A')||(p[83]!='P')||
+			(p[248]!='T')||(p[249]!='R')||(p[250]!='K')||(p[251]!='S')) return 0;
+		woz = p[3]-'0';
+		protect = 8;
+	}
+	return 1;
+}
+
+// mount from the EEPROM entry: its BPB sector must hold the same volume
+// serial number and the image's directory entry the same time stamp,
+// first cluster and size, the FAT and the root directory are not read
+unsigned char warmMount(void)
+{
+	unsigned char *p, k[4], i;
+	unsigned short dir, cluster;
+	unsigned long size;
+
+	if (eeprom_read_byte(&eeMount.magic) != MOUNT_MAGIC) return 0;
+	eeRead(&bpbAddr, bpbAddr);
+	p = readCache(bpbAddr);
+	if ((p[54]!='F')||(p[55]!='A')||(p[56]!='T')||(p[57]!='1')||(p[58]!='6')) return 0;
+	eeRead(k, serial);
+	for (i=0; i<4; i++) if (k[i]!=p[0x27+i]) return 0;
+	if (bit_is_set(PIND,3)) return 0;
+
+	eeRead(&rootAddr, rootAddr);
+	eeRead(&dirAddr, dirAddr);
+	eeRead(&dir, dir);
+	p = readCache(dirAddr+(dir>>4))+(dir&0xf)*32;
+	if ((p[0]==0x00)||(p[0]==0xe5)) return 0;
+	eeRead(k, stamp);
+	for (i=0; i<4; i++) if (k[i]!=p[22+i]) return 0;
+	// an image rewritten within the time stamp's two seconds
+	eeRead(&cluster, cluster);
+	if (cluster != *(unsigned short *)(p+26)) return 0;
+	eeRead(&size, size);
+	if (size != (*(unsigned short *)(p+28)|((unsigned long)*(unsigned short *)(p+30)<<16))) return 0;
+	eeRead(&woz, woz);
+	eeRead(&spLock, spLock);
+	protect = ((woz||spLock)?8:((p[11]&1)<<3));
+	// the newest image in the root directory is served, or the catalog's;
+	// one copied on the card since is mounted cold
+	eeRead(&catDir, catDir);
+	if (rootPick() != ((catDir!=512)?catDir:dir)) return 0;
+
+	eeRead(&fatAddr, fatAddr);
+	eeRead(&userAddr, userAddr);
+	eeRead(&sectorsPerCluster2, sectorsPerCluster2);
+	sectorsPerCluster = (1<<sectorsPerCluster2);
+	eeRead(&dskMode, dskMode);
+	eeRead(&smartPort, smartPort);
+	eeRead(&spBlocks, spBlocks);
+	eeRead(&spOfs, spOfs);
+	nicDir = dskDir = wozDir = blkDir = 512;
+	if (smartPort) blkDir = dir;
+	else if (woz) wozDir = dir;
+	else if (dskMode) dskDir = dir;
+	else nicDir = dir;
+	eeRead(&imgExtNum, extNum);
+	eeRead(imgExtLc, extLc);
+	eeRead(imgExtFt, extFt);
+	catCluster = 0xffff;
+	STAT(eeRead(&statsDir, statsDir));
+	imgExtLc[EXT_NUM+1] = 0xffff;
+	ph_track = eeprom_read_byte(&eeMount.track);
+	return 1;
+}
+
+// the entry is marked invalid while it is rewritten,
+// only the bytes that change are written
+void saveMount(void)
+{
+	unsigned char *p;
+	unsigned short dir = (smartPort?blkDir:(woz?wozDir:(dskMode?dskDir:nicDir)));
+	unsigned long size;
+
+	eeprom_update_byte(&eeMount.magic, 0);
+	p = readCache(bpbAddr);
+	eeWrite(p+0x27, serial);
+	p = readCache(dirAddr+(dir>>4))+(dir&0xf)*32;
+	eeWrite(p+22, stamp);
+	eeWrite(p+26, cluster);
+	size = (*(unsigned short *)(p+28)|((unsigned long)*(unsigned short *)(p+30)<<16));
+	eeWrite(&size, size);
+	eeWrite(&bpbAddr, bpbAddr);
+	eeWrite(&fatAddr, fatAddr);
+	eeWrite(&rootAddr, rootAddr);
+	eeWrite(&dirAddr, dirAddr);
+	eeWrite(&userAddr, userAddr);
+	eeWrite(&sectorsPerCluster2, sectorsPerCluster2);
+	eeWrite(&dir, dir);
+	eeWrite(&dskMode, dskMode);
+	eeWrite(&woz, woz);
+	eeWrite(&smartPort, smartPort);
+	eeWrite(&spLock, spLock);
+	eeWrite(&spBlocks, spBlocks);
+	eeWrite(&spOfs, spOfs);
+	eeWrite(&imgExtNum, extNum);
+	eeWrite(imgExtLc, extLc);
+	eeWrite(imgExtFt, extFt);
+	eeWrite(&catDir, catDir);
+	STAT(eeWrite(&statsDir, statsDir));
+	eeprom_update_byte(&eeMount.track, ph_track);
+	eeprom_update_byte(&eeMount.magic, MOUNT_MAGIC);
 }
 
 // called when the card is inserted or removed
@@ -872,6 +2006,12 @@ void check_eject(void)
 			if (bit_is_clear(PIND,3)) return;	
 		TIMSK0 &= ~(1<<TOIE0);
 		EIMSK &= ~(1<<INT0);
+#ifdef WRITE_ICP
+		TIMSK1 = 0;
+		writeDone = 0;
+#endif
+		// the head is here when the card comes back
+		if (inited) eeprom_update_byte(&eeMount.track, ph_track);
 		inited = 0;
 		prepare = 0;
 	} else if (!inited) {
@@ -887,9 +2027,181 @@ void check_eject(void)
 	}
 }
 
+// the buffered sectors go back to the old image, then the record the
+// Apple II asked for is mapped on the volume mounted; if it can't be,
+// the card is mounted again as if it was reinserted
+void switchImage(void)
+{
+	unsigned short cmd, idx, old;
+	unsigned char twoMg = 0;
+
+	cli();
+	cmd = switchCmd;
+	switchCmd = 0;
+	sei();
+	diskIntOff();
+#ifdef WRITE_ICP
+	TIMSK1 = 0;
+	writeDone = 0;
+#endif
+	cancelRead();
+	if (!smartPort && (sectors[0]!=0xff)) writeBackSub();
+	stopRead();
+	if (bit_is_set(PIND,3)) return;
+	cacheClear(0);
+
+	eeprom_read_block((void *)&old, (const void *)&eeCatIndex, 2);
+	idx = old;
+	if ((cmd&0xff) == SWITCH_NEXT) idx++;
+	// from the first record it wraps to 0xffff, the last one
+	else if ((cmd&0xff) == SWITCH_PREV) idx--;
+	else idx = (cmd&0xff);
+	nicDir = dskDir = wozDir = blkDir = 512;
+	dskMode = woz = smartPort = spLock = 0;
+	spOfs = 0;
+	inited = 0;
+	if (!catMount(idx, &twoMg) || !mapImage(twoMg)) {
+		eeprom_update_block((const void *)&old, (void *)&eeCatIndex, 2);
+		return;
+	}
+	saveMount();
+	startDrive();
+	diskIntOn();
+}
+
+#ifdef WRITE_ICP
+// WRITE REQUEST low starts a capture into writePtr, high ends it; the
+// transitions on WRITE are timed by the input capture, main() goes on
+ISR(INT0_vect)
+{
+	if (bit_is_clear(PIND,2)) {
+		// a SmartPort packet comes with DRIVE ENABLE off
+		if (bit_is_set(PINC,0) && !smartPort) return;
+		TIMSK0 &= ~(1<<TOIE0);
+		icpBuf = icpPtr = writePtr;
+		icpLeft = writeMax;
+		icpLatch = icpStore = 0;
+		icpLast = TCNT1;
+		// ACO is high while WRITE is low, the next edge of ACO is the other one
+		if (ACSR & (1<<ACO)) TCCR1B &= ~(1<<ICES1);
+		else TCCR1B |= (1<<ICES1);
+		TIFR1 = (1<<ICF1);
+		TIMSK1 = (1<<ICIE1);
+	} else if (TIMSK1 & (1<<ICIE1)) icpEnd();
+}
+
+// a transition on WRITE: the whole cells since the last one are 0s and a 1,
+// shifted in as the disk controller's latch does, so the host's clock may
+// drift; a nibble is stored from writeStart on
+ISR(TIMER1_CAPT_vect)
+{
+	unsigned short t = ICR1, d;
+	unsigned char c = icpLatch, n;
+
+	TCCR1B ^= (1<<ICES1);
+	TIFR1 = (1<<ICF1);
+	d = t-icpLast;
+	icpLast = t;
+	// the 0s fill the latch in 7 cells at most, the ones after a full or
+	// an empty latch are lost, as at the first transition of a write
+	if (c) {
+		while (!(c&0x80) && (d>=ICP_CELL+ICP_CELL/2)) {
+			c <<= 1;
+			d -= ICP_CELL;
+		}
+	}
+	// n is the latch after the nibble, the 1 when the 0s filled it
+	n = 1;
+	if (!(c&0x80)) {
+		c = ((c<<1)|1);
+		if (!(c&0x80)) {
+			icpLatch = c;
+			return;
+		}
+		n = 0;
+	}
+	if (c == writeStart) icpStore = 1;
+	if (icpStore) {
+		*icpPtr++ = c;
+		if (!--icpLeft) {
+			icpEnd();
+			return;
+		}
+	}
+	icpLatch = n;
+}
+
+// the capture is over, __vector_16 rests until main() starts reading
+// again, no capture is started until main() has taken this one
+void icpEnd(void)
+{
+	TIMSK1 = 0;
+	prepare = 1;
+	TIMSK0 |= (1<<TOIE0);
+	if (smartPort) spRecv = 1;
+	else {
+		writeDone = 1;
+		EIMSK &= ~(1<<INT0);
+	}
+}
+
+// called from main(), with the buffers full the next write waits
+// for restartRead() to write them back
+void icpTake(void)
+{
+	writeDone = 0;
+	writeBack();
+	if (buffNum != BUF_FULL) EIMSK |= (1<<INT0);
+}
+#endif
+
+// head stepper, every phase change is seen even while main() is busy
+// with the SD card; main() follows ph_track to the new track.
+// __vector_16 may come in right after the sei, PCINT0 itself is held
+// off while PINB is read and followed, a change meanwhile sets PCIF0
+ISR(PCINT0_vect, ISR_NOBLOCK)
+{
+	static unsigned char oldStp = 0, cmdBits = 0;
+	static unsigned short cmd;
+	unsigned char stp;
+
+	PCICR = 0;
+	stp = (PINB & 0b00001111);
+	// the magnets are off while the drive is disabled
+	if ((stp != oldStp) && bit_is_clear(PINC, 0)) {
+		unsigned char ofs =
+			((stp==0b00001000)?2:
+			((stp==0b00000100)?4:
+			((stp==0b00000010)?6:
+			((stp==0b00000001)?0:0xff))));
+		if (ofs != 0xff) {
+			cmdBits = 0;
+			ofs = ((ofs+ph_track)&7);
+			unsigned char bt = pgm_read_byte_near(stepper_table + (ofs>>1));
+			if (ofs&1) bt &= 0x0f; else bt >>= 4;
+			unsigned char trk = ph_track + ((bt & 0x08) ? (0xf8 | bt) : bt);
+			if (trk > 196) trk = 0;	
+			if (trk > 139) trk = 139;
+			ph_track = trk;
+		} else if ((stp==0b00000101)||(stp==0b00001010)) {
+			// a bit of a switch command
+			cmd = ((cmd<<1)|(stp>>3));
+			if (++cmdBits == 16) {
+				if ((cmd>>8) == SWITCH_KEY) switchCmd = (0x100|(cmd&0xff));
+				cmdBits = 0;
+			}
+		}
+	}
+	oldStp = stp;
+	PCICR = (1<<PCIE0);
+}
+
 int main(void)
 {
-	static unsigned char stp, oldStp = 0;
+	static unsigned char oldTrk = 0;
+#ifdef STATS
+	static unsigned char driveOn = 0;
+#endif
 	
 	DDRB = 0b00010000;	
 	DDRC = 0b00001010;
@@ -913,160 +2225,95 @@ int main(void)
 	ph_track = 0;
 	buffNum = 0;
 	formatting = 0;
-	writePtr = &(writeData[buffNum][0]);
+	writePtr = writeBuf(buffNum);
 
 	// timer interrupt
 	OCR0A = 0;
 	TCCR0A = 0;
 	TCCR0B = 1;
 
+	// Timer2 is a clock for idleFlush()
+	TCCR2A = 0;
+	TCCR2B = (1<<CS22)|(1<<CS21)|(1<<CS20);
+
 	// int0 interrupt
 	MCUCR = 0b00000010;
+#ifdef WRITE_ICP
+	// WRITE REQUEST both ways; WRITE as ADC2 against the bandgap, the
+	// comparator drives the input capture of Timer1 running at F_CPU
+	EICRA = 0b00000001;
+	ADCSRB = (1<<ACME);
+	ADMUX = 2;
+	ACSR = (1<<ACBG)|(1<<ACIC);
+	TCCR1A = 0;
+	TCCR1B = (1<<ICNC1)|(1<<CS10);
+#else
 	EICRA = 0b00000010;
+#endif
+
+	// pin change interrupt on PHASE-0 - PHASE-3
+	PCMSK0 = 0b00001111;
+	PCICR = (1<<PCIE0);
+	sei();
 
 	while (1) {
 		check_eject();
-		if (bit_is_set(PINC, 0)) { // disable drive
+#ifdef WRITE_ICP
+		if (inited && writeDone) icpTake();
+#endif
+		if (inited && switchCmd) switchImage();
+		idleFlush();
+		if (inited && smartPort) { // the bus, DRIVE ENABLE is off
+			spBus();
+		} else if (bit_is_set(PINC, 0)) { // disable drive
 			PORTB = 0b00100000;	 // LED off	
+			STAT(if (inited && driveOn) saveStats());
+			STAT(driveOn = 0);
 		} else { // enable drive                                                                                                                                                                   
 			PORTB = 0b00110000;
+			STAT(driveOn = 1);
 			// protect = ((PIND&0b10000000)>>4);
-			stp = (PINB & 0b00001111);
-			if (stp != oldStp) {
-				oldStp = stp;
-				unsigned char ofs =
-					((stp==0b00001000)?2:
-					((stp==0b00000100)?4:
-					((stp==0b00000010)?6:
-					((stp==0b00000001)?0:0xff))));
-				if (ofs != 0xff) {
-					ofs = ((ofs+ph_track)&7);
-					unsigned char bt = pgm_read_byte_near(stepper_table + (ofs>>1));
-					oldStp = stp;
-					if (ofs&1) bt &= 0x0f; else bt >>= 4;
-					ph_track += ((bt & 0x08) ? (0xf8 | bt) : bt);
-					if (ph_track > 196) ph_track = 0;	
-					if (ph_track > 139) ph_track = 139;
+			// a WOZ image has its own quarter tracks
+			unsigned char trk = ph_track;
+
+			if (!woz) trk >>= 2;
+
+			// the bytes filled ahead are on the old track, written sectors
+			// are held until the head leaves their track
+			if (trk != oldTrk) {
+				oldTrk = trk;
+				diskIntOff();
+				if (inited) {
+					unsigned char sc = headSector();
+
+					cancelRead();
+					if (sectors[0]!=0xff) writeBackSub();
+					sector = ((sc+1)&0xf);
+					if (woz) wozTrack(trk);
 				}
-			}			
-			if (inited && prepare) {
-				cli();
-				sector = ((sector+1)&0xf);
-				{
-					unsigned char trk = (ph_track>>2);
-					unsigned short long_sector = (unsigned short)trk*16+sector;
-					unsigned short long_cluster = long_sector>>sectorsPerCluster2;
-					unsigned char fatNum = long_cluster/FAT_NIC_ELEMS;
-					unsigned short ft;
-
-					if (fatNum != prevFatNumNic) {
-						prevFatNumNic = fatNum;
-						prepareFat(nicDir, fatNic, (560+sectorsPerCluster-1)>>sectorsPerCluster2, fatNum, FAT_NIC_ELEMS);
-					}
-					ft = fatNic[long_cluster%FAT_NIC_ELEMS];
-
-					if (((sectors[0]==sector)&&(tracks[0]==trk)) ||
-						((sectors[1]==sector)&&(tracks[1]==trk)) ||
-						((sectors[2]==sector)&&(tracks[2]==trk)) ||
-						((sectors[3]==sector)&&(tracks[3]==trk)) ||
-						((sectors[4]==sector)&&(tracks[4]==trk)))		
-						writeBackSub();	
-					cmd17Fast(userAddr+(((unsigned long)(ft-2)<<sectorsPerCluster2)
-						+ (long_sector&(sectorsPerCluster-1)))*512);
-					bitbyte = 0;
-					prepare = 0;	
-				}	
-				sei();
+				diskIntOn();
 			}
+			if (inited && restart) restartRead();
+			if (inited) fillRing();
 		}
 	}
 }
 
-void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track)
+// send a buffer as a NIC sector data block, the write command is already issued
+void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track,
+	unsigned char token)
 {
-	unsigned char c,d;
 	unsigned short i;
-	unsigned short long_sector = (unsigned short)track*16+sc;
-	unsigned short long_cluster = long_sector>>sectorsPerCluster2;
-	unsigned char fatNum = long_cluster/FAT_NIC_ELEMS;
-	unsigned short ft;
-
-	if (bit_is_set(PIND,3)) return;
-
-	if (fatNum != prevFatNumNic) {
-		prevFatNumNic = fatNum;
-		prepareFat(nicDir, fatNic,
-			(560+sectorsPerCluster-1)>>sectorsPerCluster2, fatNum, FAT_NIC_ELEMS);
-	}
-	ft = fatNic[long_cluster%FAT_NIC_ELEMS];
-	
-	PORTD = 0b00000010;
-	PORTD = 0b00000000;	
-
-	cmdFast(24, (unsigned long)userAddr+(((unsigned long)(ft-2)<<sectorsPerCluster2)
-		+ (unsigned long)(long_sector&(sectorsPerCluster-1)))*512);
 
 	writeByteFast(0xff);
-	writeByteFast(0xfe);
-	// 22 ffs
-	for (i = 0; i < 22*8; i++) {
-		PORTD = 0b00010000;
-		PORTD = 0b00110000;
-	}
-	PORTD = 0b00000000;
+	writeByteFast(token);
+	// gap, address field and data prologue
+	for (i = 0; i < 0x38; i++) writeByteFast(headByte(i, track, sc));
 
-	// sync header
-	writeByteFast(0x03);
-	writeByteFast(0xfc);
-	writeByteFast(0xff);
-	writeByteFast(0x3f);
-	writeByteFast(0xcf);
-	writeByteFast(0xf3);
-	writeByteFast(0xfc);
-	writeByteFast(0xff);
-	writeByteFast(0x3f);
-	writeByteFast(0xcf);
-	writeByteFast(0xf3);
-	writeByteFast(0xfc);
-
-	// address header
-	writeByteFast(0xd5);
-	writeByteFast(0xAA);
-	writeByteFast(0x96);
-	writeByteFast((volume>>1)|0xaa);
-	writeByteFast(volume|0xaa);
-	writeByteFast((track>>1)|0xaa);
-	writeByteFast(track|0xaa);
-	writeByteFast((sc>>1)|0xaa);
-	writeByteFast(sc|0xaa);
-	c = (volume^track^sc);
-	writeByteFast((c>>1)|0xaa);
-	writeByteFast(c|0xaa);
+	encode62((unsigned char *)0, writeBuf(bn));
 	writeByteFast(0xde);
-	writeByteFast(0xAA);
+	writeByteFast(0xaa);
 	writeByteFast(0xeb);
-
-	// sync header
-	writeByteFast(0xff);	
-	writeByteFast(0xff);
-	writeByteFast(0xff);
-	writeByteFast(0xff);
-	writeByteFast(0xff);
-
-	// data
-	for (i = 0; i < 349; i++) {
-		c = writeData[bn][i];
-		for (d = 0b10000000; d; d >>= 1) {
-			if (c&d) {
-				PORTD = 0b00010000;
-				PORTD = 0b00110000;
-			} else {
-				PORTD = 0b00000000;
-				PORTD = 0b00100000;
-			}
-		}
-	}
-	PORTD = 0b00000000;
 	for (i = 0; i < 14*8; i++) {
 		PORTD = 0b00010000;
 		PORTD = 0b00110000;
@@ -1077,13 +2324,7 @@ void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track)
 		PORTD = 0b00100000;
 	}
 	PORTD = 0b00000000;	
-	writeByteFast(0xff);
-	writeByteFast(0xff);
-	readByteFast();
-	waitFinish();
-	
-	PORTD = 0b00000010;
-	PORTD = 0b00000000;		
+	writeBlockEnd();
 }
 
 void writeBackSub(void)
@@ -1091,53 +2332,178 @@ void writeBackSub(void)
 	unsigned char i, j;
 
 	if (bit_is_set(PIND,3)) return;
+#ifdef WRITE_ICP
+	// a capture may run on into readData or readRing, the buffers wait
+	// for the next flush; diskIntOff() keeps one from starting meanwhile
+	if (writeDone || (TIMSK1 & (1<<ICIE1))) return;
+#endif
 	for (j=0; j<BUF_NUM; j++) {
 		if (sectors[j]!=0xff) {
+			STAT(stats.flushes++);
+			stopRead();
+			if (dskMode) writeBackDsk();
+			else writeBackNic();
 			for (i=0; i<BUF_NUM; i++) {
-				if (sectors[i] != 0xff)
-					writeBackSub2(i, sectors[i], tracks[i]);
 				sectors[i] = 0xff;
 				tracks[i] = 0xff;
-				writeData[i][2]=0;
 			}
 			buffNum = 0;
-			writePtr = &(writeData[buffNum][0]);
+			writePtr = writeBuf(buffNum);
+			writePtr[2] = 0;
 			break;
 		}
 	}
 }
 
+// write the buffers back to a NIC image
+void writeBackNic(void)
+{
+	unsigned char i, k, n;
+	unsigned long adrs[BUF_NUM], adr;
+
+	for (i=0; i<BUF_NUM; i++) {
+		if (sectors[i] != 0xff)
+			adrs[i] = sectorAddr(imgExtLc, imgExtFt, imgExtNum,
+				(unsigned short)tracks[i]*16+sectors[i]);
+	}
+	// write the buffers from the lowest address, buffers on
+	// consecutive sectors go in one multiple block write
+	for (;;) {
+		if (bit_is_set(PIND,3)) return;
+		for (k=BUF_NUM, i=0; i<BUF_NUM; i++) {
+			if ((sectors[i]!=0xff)&&((k==BUF_NUM)||(adrs[i]<adrs[k]))) k = i;
+		}
+		if (k==BUF_NUM) break;
+		for (n=1, adr=adrs[k]+1; ; n++, adr++) {
+			for (i=0; i<BUF_NUM; i++)
+				if ((sectors[i]!=0xff)&&(adrs[i]==adr)) break;
+			if (i==BUF_NUM) break;
+		}
+
+		PORTD = 0b00000010;
+		PORTD = 0b00000000;	
+
+		if (n==1) {
+			cmdSector(24, adrs[k]);
+			writeBackSub2(k, sectors[k], tracks[k], 0xfe);
+			sectors[k] = 0xff;
+		} else {
+			cmd25Fast(adrs[k], n);
+			for (adr=adrs[k]; adr<adrs[k]+n; adr++) {
+				for (i=0; (sectors[i]==0xff)||(adrs[i]!=adr); i++) ;
+				writeBackSub2(i, sectors[i], tracks[i], 0xfc);
+				sectors[i] = 0xff;
+			}
+			stopTranFast();
+		}
+
+		PORTD = 0b00000010;
+		PORTD = 0b00000000;		
+	}
+}
+
+// write the buffers back to a DSK image, a DSK block holds
+// two logical sectors, the one not buffered is read into readData
+void writeBackDsk(void)
+{
+	unsigned char i, k, h, logic_sector;
+	unsigned short j, blocks[BUF_NUM];
+	unsigned long adr;
+	unsigned char *half[2];
+
+	for (i=0; i<BUF_NUM; i++) {
+		if (sectors[i] != 0xff)
+			blocks[i] = (unsigned short)tracks[i]*8+
+				(pgm_read_byte_near(logicalSector+sectors[i])/2);
+	}
+	// write the blocks from the lowest one
+	for (;;) {
+		if (bit_is_set(PIND,3)) return;
+		for (k=BUF_NUM, i=0; i<BUF_NUM; i++) {
+			if ((sectors[i]!=0xff)&&((k==BUF_NUM)||(blocks[i]<blocks[k]))) k = i;
+		}
+		if (k==BUF_NUM) break;
+		logic_sector = pgm_read_byte_near(logicalSector+sectors[k]);
+		h = (logic_sector&1);
+		half[h] = writeBuf(k);
+		half[h^1] = readData;
+		// the other half may be buffered too
+		for (i=0; i<BUF_NUM; i++) {
+			if ((sectors[i]!=0xff)&&(blocks[i]==blocks[k])&&
+				((pgm_read_byte_near(logicalSector+sectors[i])&1)!=h)) {
+				half[h^1] = writeBuf(i);
+				sectors[i] = 0xff;
+			}
+		}
+		adr = sectorAddr(imgExtLc, imgExtFt, imgExtNum, blocks[k]);
+		sectors[k] = 0xff;
+		if (half[h^1] == readData) {
+			cmd17Fast(adr);
+			for (j=0; j<512; j++) {
+				if ((j>>8)==h) readByteFast();
+				else readData[j&0xff] = readByteFast();
+			}
+			readByteFast(); readByteFast(); // discard CRC bytes
+		}
+
+		PORTD = 0b00000010;
+		PORTD = 0b00000000;	
+
+		cmdSector(24, adr);
+		writeByteFast(0xff);
+		writeByteFast(0xfe);
+		for (j=0; j<512; j++) writeByteFast(half[j>>8][j&0xff]);
+		writeBlockEnd();
+
+		PORTD = 0b00000010;
+		PORTD = 0b00000000;		
+	}
+}
+
 // write back writeData into the SD card
 void writeBack(void)
 {
 	static unsigned char sec;
+#ifdef WRITE_ICP
+	// the buffers may have been written back while it was captured
+	unsigned char *p = icpBuf, sc;
+#else
+	unsigned char *p = writeBuf(buffNum), sc;
+#endif
 	
 	if (bit_is_set(PIND,3)) return;
-	if (writeData[buffNum][2]==0xAD) {
+	// a SmartPort packet is taken in main()
+	if (smartPort) {
+		spRecv = 1;
+		return;
+	}
+	if (p[2]==0xAD) {
+		p[2] = 0;
 		if (!formatting) {
-			sectors[buffNum]=sector;
-			tracks[buffNum]=(ph_track>>2);
-			sector=((((sector==0xf)||(sector==0xd))?(sector+2):(sector+1))&0xf);
-			if (buffNum == (BUF_NUM-1)) {
-				// cancel reading
-				cancelRead();
-				writeBackSub();
-				prepare = 1;
-			} else {
+			sc = headSector();
+			// keep the sector decoded, a broken data field or one captured
+			// while the buffers are full is dropped
+			if ((buffNum != BUF_FULL) && !woz && decode62(p+3)) {
+				memcp(writeBuf(buffNum), p+89, 256);
+				sectors[buffNum]=sc;
+				tracks[buffNum]=(ph_track>>2);
 				buffNum++;
-				writePtr = &(writeData[buffNum][0]);
+				writePtr = writeBuf(buffNum);
+				writePtr[2] = 0;
 			}
+			sc=((((sc==0xf)||(sc==0xd))?(sc+2):(sc+1))&0xf);
 		} else {
-			sector = sec;
+			sc = sec;
 			formatting = 0;
-			if (sec == 0xf) {
-				// cancel reading
-				cancelRead();
-				prepare = 1;
-			}
 		}
-	} if (writeData[buffNum][2]==0x96) {
-		sec = (((writeData[buffNum][7]&0x55)<<1) | (writeData[buffNum][8]&0x55));
+		// the capture may have run into the read ring or the DSK sector,
+		// main() starts reading again and writes the buffers back when full
+		nextSector = ((sc+1)&0xf);
+		restart = 1;
+		idleTicks = 0;
+		prepare = 1;
+	} else if (p[2]==0x96) {
+		sec = (((p[7]&0x55)<<1) | (p[8]&0x55));
 		formatting = 1;
 	}
 }
\ No newline at end of file
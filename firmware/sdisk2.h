@@ -0,0 +1,14 @@
+/*------------------------------------------------------
+
+	DISK II Emulator Farmware, sizes shared by sdisk2.c and sub.S
+
+------------------------------------------------------*/
+
+#ifndef SDISK2_H
+#define SDISK2_H
+
+// writeData holds BUF_NUM write buffers of 256 bytes, then the read ring
+#define BUF_NUM 5
+#define RING 416
+
+#endif
@@ -0,0 +1,553 @@
+/*------------------------------------------------------
+
+	image catalog builder for SDISK II
+
+------------------------------------------------------*/
+
+/*
+walks the FAT16 volume on an SD card (or a raw image of one) from the root
+directory down through its subdirectories and writes SDISK2.CAT in the
+root directory: every NIC, DSK, DO, WOZ, PO, HDV and 2MG image with its
+VFAT long name, sorted by path. at a cold mount sdisk2.c reads the record
+eeCatIndex says in a few sector reads, see catMount().
+
+the file, little endian:
+
+	sector 0	header
+		0	"SDISKCAT"
+		8	version, 1
+		10	record count
+		12	sector of the first record
+		14	directory count
+		16	volume serial number
+	sector 1	the directory table, 64 bytes a directory, 8 a sector
+		0	first cluster, 0 for the root directory
+		2	the parent's number in the table, 0xffff for the root directory
+		4	FNV-1a hash of the directory's sectors
+		16	path, NUL padded
+	then		the records, 64 bytes an image, 8 a sector
+		0	format: 1 NIC, 2 DSK or DO, 3 WOZ, 4 PO or HDV, 5 2MG
+		1	attributes of the directory entry
+		2	the sector holding the directory entry
+		6	the entry in that sector, 0-15
+		8	first cluster
+		10	size
+		14	the directory's number in the table
+		16	path from the root directory, NUL padded, 47 bytes at most
+
+when the card has a catalog already, a directory whose sectors hash the
+same as before keeps its records and subdirectories, only the others are
+read again. SDISK2.CAT's own root directory entry is not hashed.
+SDISK2.CAT is made when there is none and grown when it is too small.
+
+usage: catalog [-l] card
+	-l			list the records with their numbers after writing them
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEC 512
+#define REC 64
+#define PATH 48
+
+struct dir {
+	unsigned short cluster, parent;
+	unsigned long hash;
+	char path[PATH];
+};
+
+struct rec {
+	unsigned char fmt, attr, ent;
+	unsigned long sec, size;
+	unsigned short cluster, dir;
+	char path[PATH];
+};
+
+static FILE *card;
+static unsigned long bpbAddr, fatAddr, rootAddr, userAddr, rootSecs;
+static unsigned char spc, fats, serial[4];
+static unsigned short *fat, spf;
+static unsigned long clusters;
+
+static struct dir *dirs, *oldDirs;
+static struct rec *recs, *oldRecs;
+static unsigned long dirNum, recNum, oldDirNum, oldRecNum, reread;
+
+static const unsigned char catName[11] = {'S','D','I','S','K','2',' ',' ','C','A','T'};
+
+static void fail(const char *msg)
+{
+	fprintf(stderr, "catalog: %s\n", msg);
+	exit(1);
+}
+
+static void readSec(unsigned long sec, unsigned char *buf)
+{
+	if (fseek(card, (long)sec*SEC, SEEK_SET) || (fread(buf, 1, SEC, card) != SEC))
+		fail("can't read the card");
+}
+
+static void writeSec(unsigned long sec, const unsigned char *buf)
+{
+	if (fseek(card, (long)sec*SEC, SEEK_SET) || (fwrite(buf, 1, SEC, card) != SEC))
+		fail("can't write the card");
+}
+
+static unsigned short get16(const unsigned char *p)
+{
+	return (unsigned short)(p[0]|(p[1]<<8));
+}
+
+static unsigned long get32(const unsigned char *p)
+{
+	return p[0]|(p[1]<<8)|((unsigned long)p[2]<<16)|((unsigned long)p[3]<<24);
+}
+
+static void put16(unsigned char *p, unsigned long v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v>>8);
+}
+
+static void put32(unsigned char *p, unsigned long v)
+{
+	put16(p, v);
+	put16(p+2, v>>16);
+}
+
+static unsigned long clusterAddr(unsigned short c)
+{
+	return userAddr+(unsigned long)(c-2)*spc;
+}
+
+// the sectors of a directory or a file by its first cluster, 0 the root directory
+static unsigned long *chain(unsigned short c, unsigned long *num)
+{
+	unsigned long *sec = 0, n = 0, i, cap = 0;
+
+	if (!c) {
+		sec = malloc(rootSecs*sizeof(*sec));
+		for (n = 0; n < rootSecs; n++) sec[n] = rootAddr+n;
+	} else {
+		while ((c >= 2) && (c < clusters+2)) {
+			if (n+spc > cap) {
+				cap = (cap+spc)*2;
+				sec = realloc(sec, cap*sizeof(*sec));
+			}
+			for (i = 0; i < spc; i++) sec[n++] = clusterAddr(c)+i;
+			// a loop in the FAT ends the chain
+			if (n > clusters*spc) break;
+			c = fat[c];
+		}
+	}
+	*num = n;
+	return sec;
+}
+
+// the format of a directory entry by its extension, 0 if it is not an image
+static unsigned char format(const unsigned char *p)
+{
+	static const char *ext[] = {"NIC","DSK","DO ","WOZ","PO ","HDV","2MG"};
+	static const unsigned char fmt[] = {1, 2, 2, 3, 4, 4, 5};
+	unsigned char i;
+
+	for (i = 0; i < 7; i++) if (!memcmp(p+8, ext[i], 3)) return fmt[i];
+	return 0;
+}
+
+static int byPath(const void *a, const void *b)
+{
+	return strcasecmp(((const struct rec *)a)->path, ((const struct rec *)b)->path);
+}
+
+// dir/name cut to fit
+static void joinPath(char *dst, const char *dir, const char *name)
+{
+	char buf[2*PATH];
+
+	snprintf(buf, sizeof(buf), "%s%s%s", dir, *dir?"/":"", name);
+	buf[PATH-1] = 0;
+	strcpy(dst, buf);
+}
+
+static void addRec(const struct rec *r)
+{
+	if (!(recNum & 255)) recs = realloc(recs, (recNum+256)*sizeof(*recs));
+	recs[recNum++] = *r;
+}
+
+static unsigned long addDir(unsigned short cluster, unsigned short parent, const char *path)
+{
+	if (!(dirNum & 63)) dirs = realloc(dirs, (dirNum+64)*sizeof(*dirs));
+	memset(&dirs[dirNum], 0, sizeof(*dirs));
+	dirs[dirNum].cluster = cluster;
+	dirs[dirNum].parent = parent;
+	strncpy(dirs[dirNum].path, path, PATH-1);
+	return dirNum++;
+}
+
+static void walk(unsigned short cluster, unsigned short parent, const char *path);
+
+// the entries of a directory read again: images become records and
+// subdirectories are walked; a long name goes with the entry after it
+static void readDir(unsigned long *sec, unsigned long n, unsigned long num, const char *path)
+{
+	unsigned char buf[SEC], *p, sum = 0, ord = 0, k;
+	char lfn[256], name[PATH], sub[PATH];
+	unsigned long s, e, i;
+	struct rec r;
+
+	lfn[0] = 0;
+	for (s = 0; s < n; s++) {
+		readSec(sec[s], buf);
+		for (e = 0; e < 16; e++) {
+			p = buf+e*32;
+			if (!p[0]) return;
+			if (p[0] == 0xe5) {
+				lfn[0] = 0;
+				continue;
+			}
+			if (p[11] == 0x0f) {
+				// a part of the long name, the last one comes first
+				unsigned char seq = (unsigned char)(p[0]&0x1f);
+				static const unsigned char at[13] = {1,3,5,7,9,14,16,18,20,22,24,28,30};
+
+				if (p[0]&0x40) {
+					memset(lfn, 0, sizeof(lfn));
+					sum = p[13];
+				} else if ((seq != ord-1) || (p[13] != sum)) {
+					lfn[0] = 0;
+					continue;
+				}
+				ord = seq;
+				if (!seq || (seq > 19)) continue;
+				for (i = 0; i < 13; i++) {
+					unsigned short c = get16(p+at[i]);
+
+					if (!c || (c == 0xffff)) break;
+					lfn[(seq-1)*13+i] = (char)((c < 0x80)?c:'?');
+				}
+				continue;
+			}
+			// the long name belongs here if its checksum is of this short name
+			for (k = 0, i = 0; i < 11; i++) k = (unsigned char)(((k&1)?0x80:0)+(k>>1)+p[i]);
+			if (!lfn[0] || (ord != 1) || (k != sum)) {
+				// the short name, NAME.EXT
+				for (i = 0, k = 0; i < 8 && (p[i] != ' '); i++) lfn[k++] = (char)p[i];
+				if (p[8] != ' ') {
+					lfn[k++] = '.';
+					for (i = 8; i < 11 && (p[i] != ' '); i++) lfn[k++] = (char)p[i];
+				}
+				lfn[k] = 0;
+				if (p[0] == 0x05) lfn[0] = (char)0xe5;
+			}
+			snprintf(name, sizeof(name), "%s", lfn);
+			lfn[0] = 0;
+			ord = 0;
+			if ((p[0] == '.') || (p[11]&0x0e)) continue;
+			if (!num && !memcmp(p, catName, 11)) continue;
+			if (p[11]&0x10) {
+				joinPath(sub, path, name);
+				walk(get16(p+26), (unsigned short)num, sub);
+				continue;
+			}
+			if (!(r.fmt = format(p))) continue;
+			r.attr = p[11];
+			r.sec = sec[s];
+			r.ent = (unsigned char)e;
+			r.cluster = get16(p+26);
+			r.size = get32(p+28);
+			r.dir = (unsigned short)num;
+			joinPath(r.path, path, name);
+			addRec(&r);
+		}
+	}
+}
+
+// a directory and the ones below it, from the old catalog if its sectors
+// hash the same
+static void walk(unsigned short cluster, unsigned short parent, const char *path)
+{
+	unsigned char buf[SEC];
+	unsigned long *sec, n, s, i, num, hash = 2166136261UL;
+
+	for (i = 0; i < dirNum; i++) if (dirs[i].cluster == cluster) return;
+	sec = chain(cluster, &n);
+	for (s = 0; s < n; s++) {
+		readSec(sec[s], buf);
+		for (i = 0; i < SEC; i += 32) {
+			unsigned long k;
+
+			// up to the end of the directory; SDISK2.CAT changes with every
+			// catalog written and goes where the end was the first time
+			if (!buf[i]) break;
+			if (!cluster && !memcmp(buf+i, catName, 11)) continue;
+			for (k = i; k < i+32; k++) hash = ((hash^buf[k])*16777619UL)&0xffffffffUL;
+		}
+		if (i < SEC) break;
+	}
+	num = addDir(cluster, parent, path);
+	dirs[num].hash = hash;
+	for (i = 0; i < oldDirNum; i++)
+		if ((oldDirs[i].cluster == cluster) && (oldDirs[i].hash == hash)) break;
+	if (i == oldDirNum) {
+		reread++;
+		readDir(sec, n, num, path);
+	} else {
+		unsigned long o = i;
+
+		for (i = 0; i < oldRecNum; i++) {
+			if (oldRecs[i].dir != o) continue;
+			oldRecs[i].dir = (unsigned short)num;
+			addRec(&oldRecs[i]);
+		}
+		for (i = 0; i < oldDirNum; i++)
+			if ((oldDirs[i].parent == o) && (i != o))
+				walk(oldDirs[i].cluster, (unsigned short)num, oldDirs[i].path);
+	}
+	free(sec);
+}
+
+// the root directory entry of SDISK2.CAT, -1 if there is none; slot the
+// first free one
+static long catEntry(long *slot)
+{
+	unsigned char buf[SEC];
+	unsigned long s, e;
+
+	*slot = -1;
+	for (s = 0; s < rootSecs; s++) {
+		readSec(rootAddr+s, buf);
+		for (e = 0; e < 16; e++) {
+			unsigned char *p = buf+e*32;
+
+			if (((p[0] == 0) || (p[0] == 0xe5)) && (*slot < 0)) *slot = (long)(s*16+e);
+			if (!p[0]) return -1;
+			if ((p[0] != 0xe5) && !memcmp(p, catName, 11) && !(p[11]&0x18)) return (long)(s*16+e);
+		}
+	}
+	return -1;
+}
+
+// the records and directories of the catalog there is, if it is for this volume
+static void readOld(void)
+{
+	unsigned char buf[SEC], *p;
+	unsigned long *sec, n, i, first;
+	long slot, e = catEntry(&slot);
+
+	if (e < 0) return;
+	readSec(rootAddr+e/16, buf);
+	if (get16(buf+(e%16)*32+26) < 2) return;
+	sec = chain(get16(buf+(e%16)*32+26), &n);
+	if (!n) return;
+	readSec(sec[0], buf);
+	if (memcmp(buf, "SDISKCAT", 8) || (buf[8] != 1) || memcmp(buf+16, serial, 4)) {
+		free(sec);
+		return;
+	}
+	oldRecNum = get16(buf+10);
+	first = get16(buf+12);
+	oldDirNum = get16(buf+14);
+	if ((1+(oldDirNum+7)/8 > first) || (first+(oldRecNum+7)/8 > n)) {
+		oldRecNum = oldDirNum = 0;
+		free(sec);
+		return;
+	}
+	oldDirs = calloc(oldDirNum+1, sizeof(*oldDirs));
+	oldRecs = calloc(oldRecNum+1, sizeof(*oldRecs));
+	for (i = 0; i < oldDirNum; i++) {
+		if (!(i&7)) readSec(sec[1+i/8], buf);
+		p = buf+(i&7)*REC;
+		oldDirs[i].cluster = get16(p);
+		oldDirs[i].parent = get16(p+2);
+		oldDirs[i].hash = get32(p+4);
+		memcpy(oldDirs[i].path, p+16, PATH-1);
+	}
+	for (i = 0; i < oldRecNum; i++) {
+		if (!(i&7)) readSec(sec[first+i/8], buf);
+		p = buf+(i&7)*REC;
+		oldRecs[i].fmt = p[0];
+		oldRecs[i].attr = p[1];
+		oldRecs[i].sec = get32(p+2);
+		oldRecs[i].ent = p[6];
+		oldRecs[i].cluster = get16(p+8);
+		oldRecs[i].size = get32(p+10);
+		oldRecs[i].dir = get16(p+14);
+		memcpy(oldRecs[i].path, p+16, PATH-1);
+	}
+	free(sec);
+}
+
+// write the FAT to each of its copies
+static void writeFat(void)
+{
+	unsigned char buf[SEC];
+	unsigned long s, i, f;
+
+	for (s = 0; s < spf; s++) {
+		for (i = 0; i < SEC/2; i++) put16(buf+i*2, fat[s*(SEC/2)+i]);
+		for (f = 0; f < fats; f++) writeSec(fatAddr+f*spf+s, buf);
+	}
+}
+
+// SDISK2.CAT of n sectors, made or grown as needed; its sectors
+static unsigned long *catFile(unsigned long n)
+{
+	unsigned char buf[SEC], *p;
+	unsigned long *sec, have, need = (n+spc-1)/spc, c, last = 0, i;
+	long e, slot;
+	unsigned short first;
+	time_t now = time(0);
+	struct tm *t = localtime(&now);
+
+	e = catEntry(&slot);
+	if (e < 0) {
+		if (slot < 0) fail("the root directory is full");
+		e = slot;
+		readSec(rootAddr+e/16, buf);
+		p = buf+(e%16)*32;
+		memset(p, 0, 32);
+		memcpy(p, catName, 11);
+		p[11] = 0x20;
+	} else {
+		readSec(rootAddr+e/16, buf);
+		p = buf+(e%16)*32;
+	}
+	first = get16(p+26);
+	// a new entry has no cluster, chain(0) would be the root directory
+	have = 0;
+	sec = (first >= 2)?chain(first, &have):0;
+	if (have < n) {
+		// free the old chain and take the first free clusters
+		free(sec);
+		for (c = first; (c >= 2) && (c < clusters+2); ) {
+			unsigned short next = fat[c];
+
+			fat[c] = 0;
+			c = next;
+		}
+		first = 0;
+		for (c = 2, i = 0; (c < clusters+2) && (i < need); c++) {
+			if (fat[c]) continue;
+			if (last) fat[last] = (unsigned short)c;
+			else first = (unsigned short)c;
+			fat[c] = 0xffff;
+			last = c;
+			i++;
+		}
+		if (i < need) fail("the card is full");
+		writeFat();
+		sec = chain(first, &have);
+	}
+	put16(p+26, first);
+	put32(p+28, n*SEC);
+	put16(p+22, (t->tm_hour<<11)|(t->tm_min<<5)|(t->tm_sec/2));
+	put16(p+24, ((t->tm_year-80)<<9)|((t->tm_mon+1)<<5)|t->tm_mday);
+	writeSec(rootAddr+e/16, buf);
+	return sec;
+}
+
+static void writeCat(void)
+{
+	unsigned char buf[SEC], *p;
+	unsigned long first = 1+(dirNum+7)/8, n = first+(recNum+7)/8, *sec, i;
+
+	if ((dirNum > 0xffff) || (recNum > 0xffff)) fail("too many images");
+	sec = catFile(n);
+	memset(buf, 0, SEC);
+	memcpy(buf, "SDISKCAT", 8);
+	buf[8] = 1;
+	put16(buf+10, recNum);
+	put16(buf+12, first);
+	put16(buf+14, dirNum);
+	memcpy(buf+16, serial, 4);
+	writeSec(sec[0], buf);
+	for (i = 0; i < dirNum; i++) {
+		if (!(i&7)) memset(buf, 0, SEC);
+		p = buf+(i&7)*REC;
+		put16(p, dirs[i].cluster);
+		put16(p+2, dirs[i].parent);
+		put32(p+4, dirs[i].hash);
+		memcpy(p+16, dirs[i].path, PATH-1);
+		if (((i&7) == 7) || (i == dirNum-1)) writeSec(sec[1+i/8], buf);
+	}
+	for (i = 0; i < recNum; i++) {
+		if (!(i&7)) memset(buf, 0, SEC);
+		p = buf+(i&7)*REC;
+		p[0] = recs[i].fmt;
+		p[1] = recs[i].attr;
+		put32(p+2, recs[i].sec);
+		p[6] = recs[i].ent;
+		put16(p+8, recs[i].cluster);
+		put32(p+10, recs[i].size);
+		put16(p+14, recs[i].dir);
+		memcpy(p+16, recs[i].path, PATH-1);
+		if (((i&7) == 7) || (i == recNum-1)) writeSec(sec[first+i/8], buf);
+	}
+	free(sec);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: catalog [-l] card\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *fmtName[] = {"", "NIC", "DSK", "WOZ", "PO", "2MG"};
+	unsigned char buf[SEC];
+	unsigned long total, i;
+	int opt, list = 0;
+
+	while ((opt = getopt(argc, argv, "l"))!=-1) {
+		switch (opt) {
+		case 'l': list = 1; break;
+		default: usage();
+		}
+	}
+	if ((argc-optind) != 1) usage();
+	if (!(card = fopen(argv[optind], "r+b"))) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	// the volume as sdisk2.c finds it, with or without an MBR
+	readSec(0, buf);
+	if (memcmp(buf+54, "FAT16", 5)) bpbAddr = get32(buf+0x1c6);
+	readSec(bpbAddr, buf);
+	if (memcmp(buf+54, "FAT16", 5) || (get16(buf+11) != SEC)) fail("not a FAT16 volume");
+	spc = buf[13];
+	fats = buf[16];
+	spf = get16(buf+22);
+	fatAddr = bpbAddr+get16(buf+14);
+	rootAddr = fatAddr+(unsigned long)fats*spf;
+	rootSecs = (get16(buf+17)*32UL+SEC-1)/SEC;
+	userAddr = rootAddr+rootSecs;
+	total = get16(buf+19)?get16(buf+19):get32(buf+32);
+	clusters = (total-(userAddr-bpbAddr))/spc;
+	if (clusters > spf*(SEC/2UL)-2) clusters = spf*(SEC/2UL)-2;
+	memcpy(serial, buf+39, 4);
+	fat = malloc(spf*(unsigned long)SEC);
+	for (i = 0; i < spf; i++) {
+		unsigned long k;
+
+		readSec(fatAddr+i, buf);
+		for (k = 0; k < SEC/2; k++) fat[i*(SEC/2)+k] = get16(buf+k*2);
+	}
+
+	readOld();
+	walk(0, 0xffff, "");
+	qsort(recs, recNum, sizeof(*recs), byPath);
+	writeCat();
+	if (fclose(card)) fail("can't write the card");
+	printf("%lu images in %lu directories, %lu read again\n", recNum, dirNum, reread);
+	if (list) for (i = 0; i < recNum; i++) printf("%5lu %-3s %s\n", i, fmtName[recs[i].fmt], recs[i].path);
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*------------------------------------------------------
+
+	DSK, PO and NIB to NIC converter for SDISK II
+
+------------------------------------------------------*/
+
+/*
+builds sdisk2.c for the host with the headers in ../bench/host, as
+hostbench does, and writes each sector of a NIC image the way
+writeBackSub2() sends it to the card: headByte() for the gap, address
+field and data prologue, encode62() for the data field, the epilogue and
+the padding to 512 bytes. the volume is sdisk2.c's, a NIC image made
+here is byte for byte the one SDISK II writes back.
+
+	.DSK .DO	DOS 3.3 order, 143360 bytes, logicalSector[] interleave
+	.PO			ProDOS order, 143360 bytes
+	.NIB		35 tracks of 6656 nibbles, every sector is found by its
+				address field and decoded with decode62()
+
+the NIC image goes next to its source with the extension NIC, or in the
+directory given by -o. a directory on the command line converts the
+images in it, up to jobs of them at a time.
+
+usage: nicconv [-f] [-j jobs] [-o dir] image|dir...
+	-f			replace an existing NIC image
+	-j jobs		images converted at a time (default the number of CPUs)
+	-o dir		write the NIC images into dir
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define main sdisk2Main
+#include "../sdisk2.c"
+#undef main
+
+volatile unsigned char PORTB, PORTC, DDRB, DDRC, DDRD, PINB, PINC;
+volatile unsigned char TIMSK0, EIMSK, OCR0A, TCCR0A, TCCR0B, MCUCR, EICRA;
+volatile unsigned char PCMSK0, PCICR;
+volatile unsigned char TCCR1A, TCCR1B, TIMSK1, TIFR1, ACSR, ADCSRB, ADMUX;
+volatile unsigned char TCCR2A, TCCR2B, TIFR2;
+volatile unsigned short ICR1, TCNT1;
+
+static volatile unsigned char portd;
+
+// no SD card here, port D goes nowhere
+volatile unsigned char *hostPortd(void)
+{
+	return &portd;
+}
+
+// D2: no write request, D3: card inserted
+unsigned char hostPind(void)
+{
+	return 0x04;
+}
+
+void wait5(unsigned short time)
+{
+	(void)time;
+}
+
+#define TRACKS 35
+#define DSK_SIZE (TRACKS*16*256)
+#define NIB_TRACK 6656
+#define NIB_SIZE (TRACKS*NIB_TRACK)
+#define NIC_SIZE (TRACKS*16*512)
+
+enum { DSK, PO, NIB };
+
+// the ProDOS sector in each physical sector
+static const unsigned char poSector[16] = {
+	0,8,1,9,2,10,3,11,4,12,5,13,6,14,7,15};
+
+static int force;
+static const char *outDir;
+
+// a NIC sector of physical sector sc on track trk holding the 256 bytes at src
+static void nicSector(unsigned char *dst, unsigned char *src, unsigned char trk,
+	unsigned char sc)
+{
+	unsigned short i;
+
+	for (i = 0; i < 0x38; i++) dst[i] = headByte((unsigned char)i, trk, sc);
+	encode62(dst+0x38, src);
+	dst[0x18f] = 0xde;
+	dst[0x190] = 0xaa;
+	dst[0x191] = 0xeb;
+	for (i = 0x192; i < 0x1a0; i++) dst[i] = 0xff;
+	for (i = 0x1a0; i < 0x200; i++) dst[i] = 0x00;
+}
+
+// the 256 bytes of every physical sector of a NIB track, 0 if one is missing;
+// the offsets wrap round so a field across the end of the track is found
+static int nibTrack(const unsigned char *nib, unsigned char trk, unsigned char data[16][256],
+	const char *path)
+{
+	unsigned char p[343], v[4];
+	unsigned short found = 0, i, j, k;
+
+#define NIB(n) (nib[(n)%NIB_TRACK])
+	for (i = 0; i < NIB_TRACK; i++) {
+		if ((NIB(i)!=0xd5)||(NIB(i+1)!=0xaa)||(NIB(i+2)!=0x96)) continue;
+		for (k = 0; k < 4; k++)
+			v[k] = (unsigned char)(((NIB(i+3+2*k)<<1)|1)&NIB(i+4+2*k));
+		if (((v[0]^v[1]^v[2])!=v[3])||(v[1]!=trk)||(v[2]>15)) continue;
+		// the data prologue comes within the gap after the address field
+		for (j = (unsigned short)(i+14); j < i+14+48; j++)
+			if ((NIB(j)==0xd5)&&(NIB(j+1)==0xaa)&&(NIB(j+2)==0xad)) break;
+		if (j == i+14+48) continue;
+		for (k = 0; k < 343; k++) p[k] = NIB(j+3+k);
+		if (!decode62(p)) continue;
+		memcpy(data[v[2]], p+86, 256);
+		found |= (unsigned short)(1<<v[2]);
+	}
+#undef NIB
+	for (k = 0; k < 16; k++) {
+		if (!(found&(1<<k))) {
+			fprintf(stderr, "nicconv: %s: track %u sector %u not found\n", path, trk, k);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// the image type by the extension of path, -1 if it is not one
+static int imageType(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+
+	if (!ext || strchr(ext, '/')) return -1;
+	if (!strcasecmp(ext, ".dsk") || !strcasecmp(ext, ".do")) return DSK;
+	if (!strcasecmp(ext, ".po")) return PO;
+	if (!strcasecmp(ext, ".nib")) return NIB;
+	return -1;
+}
+
+// the NIC image of path, the extension in the case of the source's
+static void nicPath(char *dst, size_t n, const char *path)
+{
+	const char *base = strrchr(path, '/'), *ext = strrchr(path, '.');
+	int lower = (ext[1]>='a')&&(ext[1]<='z');
+
+	base = base?base+1:path;
+	if (outDir) snprintf(dst, n, "%s/%.*s%s", outDir, (int)(ext-base), base, lower?".nic":".NIC");
+	else snprintf(dst, n, "%.*s%s", (int)(ext-path), path, lower?".nic":".NIC");
+}
+
+// convert one image, 0 on an error
+static int convert(const char *path)
+{
+	static unsigned char in[NIB_SIZE+1], out[NIC_SIZE], data[16][256];
+	char dst[4096];
+	int type = imageType(path);
+	size_t len, want = (type==NIB)?NIB_SIZE:DSK_SIZE;
+	unsigned char trk, sc;
+	FILE *f;
+
+	nicPath(dst, sizeof(dst), path);
+	if (!force && !access(dst, F_OK)) {
+		fprintf(stderr, "nicconv: %s exists, skipped\n", dst);
+		return 1;
+	}
+	if (!(f = fopen(path, "rb"))) {
+		perror(path);
+		return 0;
+	}
+	len = fread(in, 1, sizeof(in), f);
+	fclose(f);
+	if (len != want) {
+		fprintf(stderr, "nicconv: %s: %lu bytes, not %lu\n", path,
+			(unsigned long)len, (unsigned long)want);
+		return 0;
+	}
+	for (trk = 0; trk < TRACKS; trk++) {
+		if ((type==NIB) && !nibTrack(in+trk*NIB_TRACK, trk, data, path)) return 0;
+		for (sc = 0; sc < 16; sc++) {
+			unsigned char *src;
+
+			if (type == NIB) src = data[sc];
+			else if (type == PO) src = in+(trk*16+poSector[sc])*256;
+			else src = in+(trk*16+pgm_read_byte_near(logicalSector+sc))*256;
+			nicSector(out+(trk*16+sc)*512, src, trk, sc);
+		}
+	}
+	if (!(f = fopen(dst, "wb"))) {
+		perror(dst);
+		return 0;
+	}
+	len = fwrite(out, 1, NIC_SIZE, f);
+	if (fclose(f) || (len != NIC_SIZE)) {
+		perror(dst);
+		unlink(dst);
+		return 0;
+	}
+	printf("%s -> %s\n", path, dst);
+	return 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: nicconv [-f] [-j jobs] [-o dir] image|dir...\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char **paths = 0, *p;
+	size_t num = 0, cap = 0, next = 0;
+	int opt, jobs = (int)sysconf(_SC_NPROCESSORS_ONLN), running = 0, status, fail = 0, i;
+	struct stat st;
+	struct dirent *de;
+	DIR *d;
+
+	while ((opt = getopt(argc, argv, "fj:o:"))!=-1) {
+		switch (opt) {
+		case 'f': force = 1; break;
+		case 'j': jobs = atoi(optarg); break;
+		case 'o': outDir = optarg; break;
+		default: usage();
+		}
+	}
+	if ((optind==argc)||(jobs<1)) usage();
+
+	// the images named and the ones in the directories named
+	for (i = optind; i < argc; i++) {
+		if (stat(argv[i], &st)) {
+			perror(argv[i]);
+			fail = 1;
+			continue;
+		}
+		if (!S_ISDIR(st.st_mode)) {
+			if (imageType(argv[i]) < 0) {
+				fprintf(stderr, "nicconv: %s: not a DSK, DO, PO or NIB image\n", argv[i]);
+				fail = 1;
+				continue;
+			}
+			d = 0;
+		} else if (!(d = opendir(argv[i]))) {
+			perror(argv[i]);
+			fail = 1;
+			continue;
+		}
+		do {
+			if (d) {
+				if (!(de = readdir(d))) break;
+				if (imageType(de->d_name) < 0) continue;
+				p = malloc(strlen(argv[i])+strlen(de->d_name)+2);
+				sprintf(p, "%s/%s", argv[i], de->d_name);
+			} else p = argv[i];
+			if (num == cap) {
+				cap = cap?cap*2:64;
+				paths = realloc(paths, cap*sizeof(*paths));
+			}
+			paths[num++] = p;
+		} while (d);
+		if (d) closedir(d);
+	}
+
+	// a process an image, jobs of them at a time
+	while ((next < num) || running) {
+		if ((next < num) && (running < jobs)) {
+			pid_t pid;
+
+			fflush(stdout);
+			if ((pid = fork()) < 0) {
+				perror("fork");
+				fail = 1;
+				num = next;
+				continue;
+			}
+			if (!pid) {
+				status = convert(paths[next]);
+				fflush(stdout);
+				_exit(status?0:1);
+			}
+			next++;
+			running++;
+			continue;
+		}
+		if (wait(&status) < 0) break;
+		running--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) fail = 1;
+	}
+	return fail;
+}